@@ -25,6 +25,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define LRG_V_MAJOR 1
 #define LRG_V_MINOR 4
 
+/* the Linux-specific interfaces of io_uring and zero-copy output need the
+   GNU feature test macro, which must be defined before any system header is
+   included. LRG_ZERO_COPY is on unless it is turned off */
+#if !LRG_NO_POSIX && defined(__linux__) && !defined(_GNU_SOURCE) &&           \
+    (LRG_IO_URING || !defined(LRG_ZERO_COPY) || LRG_ZERO_COPY)
+#define _GNU_SOURCE 1
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
@@ -32,6 +40,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if !LRG_NO_C99 && defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
 #define LRG_C99 1
@@ -65,7 +74,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     _POSIX_VERSION >= _POSIX_C_SOURCE
 #define LRG_POSIX 1
 #include <sys/stat.h>
-#include <time.h>
 #else
 #define LRG_POSIX 0
 #endif
@@ -103,12 +111,50 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef LRG_BACKWARD_SCAN
 #define LRG_BACKWARD_SCAN LRG_POSIX
 #endif
-/* do backwards scan if the target line number is greater than...
-   (must always be at least 1) */
+/* do backwards scan if the target line number is greater than... */
 #ifndef LRG_BACKWARD_SCAN_THRESHOLD
 #define LRG_BACKWARD_SCAN_THRESHOLD 128
 #endif
 
+/* remember where lines start while scanning seekable files, so that going
+   back to an earlier line only scans from the closest line seen before it
+   instead of from the start of the file. like LRG_BACKWARD_SCAN, requires
+   binary mode */
+#ifndef LRG_CHECKPOINTS
+#define LRG_CHECKPOINTS LRG_POSIX
+#endif
+/* the minimum number of bytes between two remembered lines. the spacing is
+   doubled whenever LRG_CHECKPOINTS_MAX lines are remembered */
+#ifndef LRG_CHECKPOINT_SPACING
+#define LRG_CHECKPOINT_SPACING (1 << 20)
+#endif
+/* the most lines remembered per file */
+#define LRG_CHECKPOINTS_MAX 65536
+
+/* support files where every line has the same length (--record-size), in
+   which lrg can seek straight to any line. like LRG_BACKWARD_SCAN, requires
+   binary mode */
+#ifndef LRG_RECORDS
+#define LRG_RECORDS LRG_POSIX
+#endif
+
+/* ranges that are not in ascending order are read in one forward pass, with
+   the lines needed later kept aside until their turn. this is how pipes get
+   such ranges; seekable files only do it if no more than LRG_REORDER_LINES
+   lines would need to be kept aside, and seek back otherwise */
+#ifndef LRG_REORDER_LINES
+#define LRG_REORDER_LINES 65536
+#endif
+/* how many bytes of lines kept aside stay in memory. any more go into a
+   temporary file */
+#ifndef LRG_REORDER_MEMORY
+#if LRG_POSIX || LRG_WIN32
+#define LRG_REORDER_MEMORY (1 << 20)
+#else
+#define LRG_REORDER_MEMORY 16384
+#endif
+#endif
+
 /* set to 1 if a memcnt implementation is linked from elsewhere */
 #ifndef LRG_HOSTED_MEMCNT
 #define LRG_HOSTED_MEMCNT 0
@@ -130,11 +176,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     } */
 size_t memcnt(const void *s, int c, size_t n);
 
+/* include SSE2, AVX2, AVX-512BW and VPOPCNTDQ implementations of memcnt and
+   pick the fastest one the CPU supports when lrg starts, so that generic builds
+   (no -march=native) count fast. x86 with GCC or Clang only, and never used
+   with LRG_HOSTED_MEMCNT */
+#ifndef LRG_SIMD_MEMCNT
+#define LRG_SIMD_MEMCNT 1
+#endif
+#if LRG_SIMD_MEMCNT &&                                                         \
+    (LRG_HOSTED_MEMCNT || !(defined(__x86_64__) || defined(__i386__)) ||       \
+     !(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 6)))
+#undef LRG_SIMD_MEMCNT
+#define LRG_SIMD_MEMCNT 0
+#endif
+
 /* use memcnt to skip lines if we still have a long way to go. this is not
    worth it unless memcnt is really fast (such as when it's vectorized and
    uses CPU intrinsics), at least about as fast as the memchr of your libc */
 #ifndef LRG_FAST_MEMCNT
-#define LRG_FAST_MEMCNT LRG_HOSTED_MEMCNT
+#define LRG_FAST_MEMCNT (LRG_HOSTED_MEMCNT || LRG_SIMD_MEMCNT)
 #endif
 
 /* 0 = always use fillbuf_file. 1 = always use fillbuf_pipe.
@@ -148,7 +208,10 @@ size_t memcnt(const void *s, int c, size_t n);
 #endif
 
 /* buffer size. adjusting this can improve performance considerably and is
-   a good place to start if you wish to build a fast lrg for your system */
+   a good place to start if you wish to build a fast lrg for your system.
+   on POSIX, this is only the default; the buffer size is chosen for every file
+   at runtime based on its type, size and block size, up to LRG_BUFSIZE_MAX,
+   unless given with --buffer-size */
 #ifndef LRG_BUFSIZE
 #if LRG_POSIX || LRG_WIN32
 #define LRG_BUFSIZE BUFSIZ * 4
@@ -156,6 +219,14 @@ size_t memcnt(const void *s, int c, size_t n);
 #define LRG_BUFSIZE BUFSIZ
 #endif
 #endif
+/* the largest buffer size that will be chosen automatically */
+#ifndef LRG_BUFSIZE_MAX
+#if LRG_POSIX || LRG_WIN32
+#define LRG_BUFSIZE_MAX (4 << 20)
+#else
+#define LRG_BUFSIZE_MAX LRG_BUFSIZE
+#endif
+#endif
 /* line range buffer size. this is only the static allocation;
    if there are too many ranges to fit, dynamic allocation will be used to
    get an expanded buffer */
@@ -163,9 +234,11 @@ size_t memcnt(const void *s, int c, size_t n);
 #define LRG_LINEBUFSIZE 32
 #endif
 
-/* align buffer to N bytes. only actually happens if the compiler supports it */
+/* align buffers to N bytes. only actually happens on POSIX */
 #ifndef LRG_BUFFER_ALIGN
-#if LRG_C99 && CHAR_BIT == 8 && LRG_IS64BIT
+#if LRG_POSIX
+#define LRG_BUFFER_ALIGN 4096
+#elif LRG_C99 && CHAR_BIT == 8 && LRG_IS64BIT
 #define LRG_BUFFER_ALIGN 8
 #elif LRG_C99 && CHAR_BIT == 8 && LRG_IS64BIT
 #define LRG_BUFFER_ALIGN 4
@@ -180,6 +253,119 @@ size_t memcnt(const void *s, int c, size_t n);
 #define LRG_POSIX_FADVISE 1
 #endif
 
+/* read regular files that fit in the read buffer in one go when they are
+   opened, and then from memory, skipping everything that only pays off for
+   larger files (mapping, read-ahead advice, line indexes) */
+#ifndef LRG_SMALL_FILES
+#define LRG_SMALL_FILES 1
+#endif
+
+/* when going through several files one at a time, open the next file while
+   the current one is being read and have the kernel start reading its first
+   LRG_READ_AHEAD bytes, unless it is small enough to be read with a single
+   read. requires LRG_POSIX_FADVISE */
+#ifndef LRG_OPEN_AHEAD
+#define LRG_OPEN_AHEAD 1
+#endif
+
+#ifndef LRG_READ_AHEAD
+#define LRG_READ_AHEAD LRG_BUFSIZE_MAX
+#endif
+
+/* map seekable regular files into memory and scan the mapping directly
+   instead of copying everything through the read buffer. a file that is
+   truncated while it is mapped kills lrg with SIGBUS, so this is only done
+   with --mmap, or for a file that matches its line index (which is only
+   used for files that are not changed). POSIX only; falls back to reading
+   if the file cannot be mapped */
+#ifndef LRG_MMAP
+#define LRG_MMAP 1
+#endif
+/* how many bytes of a mapped file are handed to the scanner at a time */
+#ifndef LRG_MMAP_BLOCK
+#define LRG_MMAP_BLOCK (1 << 20)
+#endif
+
+/* read seekable files asynchronously with io_uring, keeping several buffers
+   in flight so that the disk keeps reading while we scan. Linux only and
+   disabled by default; if the ring cannot be set up, mmap or read is used */
+#ifndef LRG_IO_URING
+#define LRG_IO_URING 0
+#endif
+/* number of buffers (and reads) in flight with io_uring */
+#ifndef LRG_IO_URING_DEPTH
+#define LRG_IO_URING_DEPTH 4
+#endif
+
+/* support reading the input on a separate thread (--threads-io), so that
+   reading overlaps with scanning even for pipes. POSIX only */
+#ifndef LRG_THREADS
+#define LRG_THREADS 1
+#endif
+/* number of buffers the reader thread may fill ahead of the scanner */
+#ifndef LRG_THREAD_BUFFERS
+#define LRG_THREAD_BUFFERS 4
+#endif
+/* number of output buffers that may wait for the writer thread
+   (--threads-out) before the scanner has to wait for it */
+#ifndef LRG_WRITER_BUFFERS
+#define LRG_WRITER_BUFFERS 8
+#endif
+/* with --jobs, each thread counts newlines in chunks of this many bytes */
+#ifndef LRG_JOBS_CHUNK
+#define LRG_JOBS_CHUNK (4 << 20)
+#endif
+/* the most threads --jobs can ask for */
+#define LRG_JOBS_MAX 256
+/* with --jobs, process several input files at the same time, each on a
+   thread of its own, and write out their output in order. needs
+   LRG_THREADS and thread-local variables (C11 or GCC) */
+#ifndef LRG_PARALLEL_FILES
+#define LRG_PARALLEL_FILES 1
+#endif
+
+/* support line indexes (--build-index): files listing the byte offset of
+   every LRG_INDEX_INTERVAL-th line of a file, so that lrg can seek close to
+   any line right away. POSIX only */
+#ifndef LRG_INDEX
+#define LRG_INDEX 1
+#endif
+/* the number of lines between two offsets in an index */
+#ifndef LRG_INDEX_INTERVAL
+#define LRG_INDEX_INTERVAL 1024
+#endif
+
+/* output ranges that do not fit in one buffer straight from the file with
+   copy_file_range (if stdout is a regular file) or splice (if it is a pipe),
+   so that their contents never pass through user space. a range that does
+   not go up to EOF is copied only as far as an indexed or already seen line.
+   Linux only; falls back to normal writes if the kernel refuses */
+#ifndef LRG_ZERO_COPY
+#define LRG_ZERO_COPY 1
+#endif
+
+/* write output with writev instead of through stdio, gathering line numbers
+   and short lines into a buffer of our own and taking longer stretches of
+   lines straight from where they were read. POSIX only; otherwise the same
+   pieces are written with fwrite */
+#ifndef LRG_WRITEV
+#define LRG_WRITEV 1
+#endif
+/* the size of the output buffer */
+#ifndef LRG_OUT_BUFSIZE
+#if LRG_POSIX || LRG_WIN32
+#define LRG_OUT_BUFSIZE 65536
+#else
+#define LRG_OUT_BUFSIZE BUFSIZ
+#endif
+#endif
+/* output at least this long is not copied into the output buffer */
+#ifndef LRG_OUT_DIRECT
+#define LRG_OUT_DIRECT 1024
+#endif
+/* the most pieces of output written at once */
+#define LRG_OUT_IOVECS 16
+
 #if LRG_C99
 typedef unsigned long long linenum_t;
 #define LINENUM_MAX ULLONG_MAX
@@ -212,13 +398,17 @@ typedef unsigned long linenum_t;
 #define RESTRICT
 #endif
 
-/* ALIGNAS: aligns buffer to N-byte boundary, or does nothing if N == 0 */
-#if LRG_C11
-#define ALIGNAS(N) _Alignas(N)
+/* a variable that every thread has a copy of its own */
+#if !LRG_PARALLEL_FILES || !LRG_THREADS || !LRG_POSIX
+#define LRG_THREAD_LOCAL
+#elif LRG_C11
+#define LRG_THREAD_LOCAL _Thread_local
 #elif defined(__GNUC__)
-#define ALIGNAS(N) __attribute__((aligned((N) ? (N) : 1)))
+#define LRG_THREAD_LOCAL __thread
 #else
-#define ALIGNAS(N)
+#undef LRG_PARALLEL_FILES
+#define LRG_PARALLEL_FILES 0
+#define LRG_THREAD_LOCAL
 #endif
 
 #ifdef __GNUC__
@@ -242,6 +432,16 @@ typedef unsigned long linenum_t;
 #define lrg_realloc realloc
 #define lrg_free free
 
+/* allocates a buffer aligned to LRG_BUFFER_ALIGN. freed with lrg_free */
+INLINE void *lrg_malloc_aligned(size_t size) {
+#if LRG_POSIX && LRG_BUFFER_ALIGN
+    void *p;
+    return posix_memalign(&p, LRG_BUFFER_ALIGN, size) ? NULL : p;
+#else
+    return lrg_malloc(size);
+#endif
+}
+
 /* ========================================================= */
 /*                        definitions                        */
 /* ========================================================= */
@@ -251,14 +451,58 @@ struct lrg_linerange {
     linenum_t last;
     /* original range format given as a parameter. used for error msgs */
     const char *text;
+    /* LRG_FIRST_FROM_END and LRG_LAST_FROM_END if first or last is the
+       number of lines before the last line instead */
+    int from_end;
+    /* only every step-th line from first is in the range */
+    linenum_t step;
+};
+
+#define LRG_FIRST_FROM_END 1
+#define LRG_LAST_FROM_END 2
+
+/* a plain range of --ranges-from, with no step and not counted from the end */
+struct lrg_interval {
+    linenum_t first;
+    linenum_t last;
 };
 
+/* whether a range has a line counted from the start (other than up to the
+   end, which is the same counted either way) */
+INLINE int lrg_counts_from_start(const struct lrg_linerange *range) {
+    return !(range->from_end & LRG_FIRST_FROM_END) ||
+           (!(range->from_end & LRG_LAST_FROM_END) &&
+            range->last != LINENUM_MAX);
+}
+
+/* the first line at or after line (>= range->first) that is in the range,
+   or LINENUM_MAX if there are no more */
+INLINE linenum_t lrg_next_in_range(const struct lrg_linerange *range,
+                                   linenum_t line) {
+    linenum_t gap = (line - range->first) % range->step;
+    if (!gap)
+        return line;
+    gap = range->step - gap;
+    return gap > LINENUM_MAX - line ? LINENUM_MAX : line + gap;
+}
+
 /* argv[0] */
 static const char *myname;
 /* the flags that the user gave */
-static int show_linenums = 0, show_files = 0, warn_noline = 0, error_on_eof = 0;
-/* any of our files got EOF? */
-static int got_eof = 0;
+static int show_linenums = 0, show_files = 0, warn_noline = 0, error_on_eof = 0,
+           unique_lines = 0;
+/* any of our files got EOF? (on this thread) */
+static LRG_THREAD_LOCAL int got_eof = 0;
+/* read buffer size given with --buffer-size, or 0 to choose automatically */
+static size_t buffer_size = 0;
+#if LRG_RECORDS
+/* the length of every line of the input including the newline
+   (--record-size), 0 if not known, or LRG_RECORD_AUTO to guess it */
+static unsigned long record_size = 0;
+#define LRG_RECORD_AUTO ULONG_MAX
+#endif
+/* the memcnt implementation in use, shown by --versionversion */
+static const char *memcnt_name = LRG_HOSTED_MEMCNT ? "hosted" : "generic";
 
 /* ========================================================= */
 /*                        support code                       */
@@ -320,10 +564,21 @@ static const char *STDIN_FILE = "-";
 #define LANGUAGE_CODE "en"
 /* how stdin is shown in error messages, etc. */
 #define STDIN_FILENAME_APPEARANCE "(stdin)"
-/* for -f/--file-names */
-#define FILE_DISPLAY_FMT "%s\n"
-/* for -l/--line-numbers */
-#define LINE_DISPLAY_FMT " %7" LINENUM_FMT "   "
+/* how the file that lines are kept aside in is shown in error messages */
+#define TEMP_FILENAME_APPEARANCE "(temporary file)"
+/* how the ranges of --sample are shown in error messages */
+#define SAMPLE_TEXT "--sample"
+/* for -f/--file-names, after the name of the file */
+#define FILE_DISPLAY_AFTER "\n"
+/* for -l/--line-numbers, the line number right-aligned to a width and the
+   text around it */
+#define LINE_DISPLAY_BEFORE " "
+#define LINE_DISPLAY_WIDTH 7
+#define LINE_DISPLAY_AFTER "   "
+/* for --count */
+#define COUNT_DISPLAY_FMT "%7" LINENUM_FMT " %s\n"
+/* the name of the sum of all files for --count */
+#define COUNT_TOTAL_TEXT "total"
 
 #if LRG_DOS
 #include <conio.h>
@@ -377,16 +632,34 @@ static void lrg_printversionversion(void) {
     PRINT_FLAG("%d", LRG_C11);
     PRINT_FLAG("%d", LRG_BACKWARD_SCAN);
     PRINT_FLAG("%d", LRG_BACKWARD_SCAN_THRESHOLD);
+    PRINT_FLAG("%d", LRG_CHECKPOINTS);
+    PRINT_FLAG("%d", LRG_CHECKPOINT_SPACING);
+    PRINT_FLAG("%d", LRG_RECORDS);
+    PRINT_FLAG("%d", LRG_REORDER_LINES);
+    PRINT_FLAG("%d", LRG_REORDER_MEMORY);
     PRINT_FLAG("%d", LRG_HOSTED_MEMCNT);
+    PRINT_FLAG("%d", LRG_SIMD_MEMCNT);
     PRINT_FLAG("%d", LRG_FAST_MEMCNT);
     PRINT_FLAG("%d", LRG_FILLBUF_MODE);
     PRINT_FLAG("%d", LRG_BUFSIZE);
+    PRINT_FLAG("%d", LRG_BUFSIZE_MAX);
     PRINT_FLAG("%d", LRG_POSIX_FADVISE);
+    PRINT_FLAG("%d", LRG_MMAP);
+    PRINT_FLAG("%d", LRG_MMAP_BLOCK);
+    PRINT_FLAG("%d", LRG_IO_URING);
+    PRINT_FLAG("%d", LRG_IO_URING_DEPTH);
+    PRINT_FLAG("%d", LRG_THREADS);
+    PRINT_FLAG("%d", LRG_THREAD_BUFFERS);
+    PRINT_FLAG("%d", LRG_JOBS_CHUNK);
+    PRINT_FLAG("%d", LRG_INDEX);
+    PRINT_FLAG("%d", LRG_INDEX_INTERVAL);
+    PRINT_FLAG("%d", LRG_ZERO_COPY);
     PRINT_FLAG("%d", LRG_LINEBUFSIZE);
     PRINT_FLAG("%d", LRG_BUFFER_ALIGN);
     PRINT_FLAG("%d", LRG_SUPPORT_LPS);
     PRINT_FLAG("%" LINENUM_FMT, LINENUM_MAX);
     PRINT_FLAG("%%%s", LINENUM_FMT);
+    fprintf(stdout, "memcnt: %s\n", memcnt_name);
 }
 
 static void lrg_printhelp(void) {
@@ -394,9 +667,8 @@ static void lrg_printhelp(void) {
     fprintf(stdout,
             "\nUsage: %s [OPTION]... RANGE[,RANGE]... [FILE]...\n"
             "Prints a specific range of lines from the given file.\n"
-            "Note that 'rewinding' might be impossible - once a line "
-            "has been printed,\nit is possible that only lines after it "
-            "can be printed.\n"
+            "Ranges may be given in any order, even when reading from a "
+            "pipe.\n"
             "Line numbers start at 1.\n\n",
             myname);
 #if LRG_DOS
@@ -415,6 +687,54 @@ static void lrg_printhelp(void) {
             "                 print line numbers before each line\n"
             "  -w, --warn-eof\n"
             "                 print a warning when a line is not found\n");
+    fprintf(stdout,
+            "  --unique\n"
+            "                 print lines in more than one range only once\n"
+            "  --ranges-from <file>\n"
+            "                 read the ranges from a file instead, and print\n"
+            "                 their lines in order and only once\n");
+    fprintf(stdout,
+            "  --sample <k>\n"
+            "                 print k lines picked at random from every file\n"
+            "                 instead of ranges, in order\n"
+            "  --seed <s>\n"
+            "                 pick the same lines every time for the same s\n"
+            "  --count\n"
+            "                 print the number of lines in every file instead\n"
+            "                 of any lines\n");
+    fprintf(stdout,
+            "  --buffer-size <x>\n"
+            "                 read input x bytes at a time\n"
+            "                 (suffixes K, M and G are allowed)\n");
+#if LRG_MMAP
+    fprintf(stdout,
+            "  --mmap\n"
+            "                 map files into memory instead of reading them\n"
+            "                 (they must not be truncated meanwhile)\n");
+#endif
+#if LRG_THREADS
+    fprintf(stdout,
+            "  --threads-io\n"
+            "                 read input on a separate thread\n"
+            "  --threads-out\n"
+            "                 write output on a separate thread\n"
+            "  --jobs <n>\n"
+            "                 read several files, or count lines in one, with\n"
+            "                 n threads\n");
+#endif
+#if LRG_RECORDS
+    fprintf(stdout,
+            "  --record-size <n>, --record-size auto\n"
+            "                 every line is n bytes long including the newline\n"
+            "                 (or guess whether they are all the same length)\n");
+#endif
+#if LRG_INDEX
+    fprintf(stdout,
+            "  --build-index <file>\n"
+            "                 write a line index for a file\n"
+            "  --no-index\n"
+            "                 do not use line indexes\n");
+#endif
 #if LRG_SUPPORT_LPS
     fprintf(stdout,
             "  --lps, --lines-per-second <x>\n"
@@ -435,18 +755,26 @@ static void lrg_printhelp(void) {
             "                 the lines around line number N\n"
             "                 equivalent to (N-M)-(N+M), therefore\n"
             "                 displaying 2*M+1 lines\n"
-            "                 if M not specified, defaults to 3\n\n");
+            "                 if M not specified, defaults to 3\n");
+    fprintf(stdout,
+            "   $, $-N\n"
+            "                 the last line, and the line N lines before it;\n"
+            "                 may be used in place of N or M above\n"
+            "   range:S\n"
+            "                 every S-th line of the range from its first\n\n");
 }
 
 /* used in error messages */
 #define OPER_SEEK "seeking"
 #define OPER_OPEN "opening"
 #define OPER_READ "reading"
+#define OPER_WRITE "writing"
 
 /* error messages */
 #define OPT_ERR_INVAL "invalid option"
 #define OPT_ERR_UNSUP "option not supported on this build"
 #define OPT_ERR_PARAM "invalid or missing parameter"
+#define OPT_ERR_STDIN "cannot read both the ranges and the input from stdin"
 #define TRY_HELP "Try '%s --help' for more information.\n"
 
 INLINE void lrg_showusage(void) {
@@ -499,6 +827,12 @@ INLINE void lrg_alloc_fail(void) {
 /*                   memcnt implementation                   */
 /* ========================================================= */
 
+#if LRG_SIMD_MEMCNT
+/* the implementation below becomes the fallback of the SIMD kernels */
+#define memcnt memcnt_generic
+static size_t memcnt(const void *ptr, int value, size_t num);
+#endif
+
 #if !LRG_HOSTED_MEMCNT
 /* counts the number of bytes equal to value within a buffer.
    simple implementation that is designed to be optimized by a compiler.
@@ -512,29 +846,348 @@ size_t memcnt(const void *ptr, int value, size_t num) {
 }
 #endif
 
+#undef memcnt
+
+/* finds the k-th byte equal to value within a buffer, where k = *count
+   (at least 1). memchr, but for k > 1 */
+static void *memnchr_generic(const void *ptr, int value, size_t *count,
+                             size_t num) {
+    const char *p = (const char *)ptr, *end = p + num;
+    size_t k = *count;
+#if LRG_FAST_MEMCNT
+    /* count the bytes in whole chunks until we reach the right one */
+    while (end - p > 256) {
+        size_t c = memcnt(p, value, 256);
+        if (c >= k)
+            break;
+        k -= c, p += 256;
+    }
+#endif
+    while ((p = (const char *)memchr(p, value, end - p)) != NULL) {
+        if (!--k)
+            return (void *)p;
+        ++p;
+    }
+    *count = k;
+    return NULL;
+}
+
+#if LRG_SIMD_MEMCNT
+#include <immintrin.h>
+
+/* the SSE2, AVX2 and AVX-512BW kernels work the same way: every byte that
+   compares equal subtracts -1 from a vector of byte counters, which are
+   summed up with PSADBW before they can overflow (every 255 iterations).
+   with VPOPCNTDQ, the compare masks are counted directly instead */
+
+/* VPOPCNTDQ needs GCC 7 or Clang 6 */
+#if defined(__clang__) ? __clang_major__ >= 6 : __GNUC__ >= 7
+#define LRG_VPOPCNT 1
+#else
+#define LRG_VPOPCNT 0
+#endif
+
+__attribute__((target("sse2"))) static size_t
+memcnt_sse2(const void *ptr, int value, size_t num) {
+    const unsigned char *p = (const unsigned char *)ptr;
+    const __m128i v = _mm_set1_epi8((char)value), z = _mm_setzero_si128();
+    size_t c = 0;
+    while (num >= 16) {
+        __m128i acc = z;
+        size_t n = num / 16 > 255 ? 255 : num / 16;
+        num -= n * 16;
+        while (n--) {
+            acc = _mm_sub_epi8(
+                acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), v));
+            p += 16;
+        }
+        acc = _mm_sad_epu8(acc, z);
+        c += (unsigned)_mm_cvtsi128_si32(acc) +
+             (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+    return c + memcnt_generic(p, value, num);
+}
+
+__attribute__((target("avx2"))) static size_t
+memcnt_avx2(const void *ptr, int value, size_t num) {
+    const unsigned char *p = (const unsigned char *)ptr;
+    const __m256i v = _mm256_set1_epi8((char)value),
+                  z = _mm256_setzero_si256();
+    size_t c = 0;
+    while (num >= 32) {
+        __m256i acc = z;
+        __m128i sum;
+        size_t n = num / 32 > 255 ? 255 : num / 32;
+        num -= n * 32;
+        while (n--) {
+            acc = _mm256_sub_epi8(
+                acc,
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), v));
+            p += 32;
+        }
+        acc = _mm256_sad_epu8(acc, z);
+        sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                            _mm256_extracti128_si256(acc, 1));
+        c += (unsigned)_mm_cvtsi128_si32(sum) +
+             (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+    return c + memcnt_sse2(p, value, num);
+}
+
+__attribute__((target("avx512bw"))) static size_t
+memcnt_avx512bw(const void *ptr, int value, size_t num) {
+    const unsigned char *p = (const unsigned char *)ptr;
+    const __m512i v = _mm512_set1_epi8((char)value),
+                  z = _mm512_setzero_si512();
+    size_t c = 0;
+    while (num) {
+        __m512i acc = z;
+        __m256i sum4;
+        __m128i sum;
+        size_t n = num / 64 > 255 ? 255 : num / 64;
+        num -= n * 64;
+        while (n--) {
+            acc = _mm512_sub_epi8(
+                acc, _mm512_movm_epi8(_mm512_cmpeq_epi8_mask(
+                         _mm512_loadu_si512((const void *)p), v)));
+            p += 64;
+        }
+        if (num < 64) {
+            /* the tail, with a masked load that cannot fault */
+            __mmask64 m = ((__mmask64)1 << num) - 1;
+            acc = _mm512_sub_epi8(
+                acc, _mm512_movm_epi8(_mm512_mask_cmpeq_epi8_mask(
+                         m, _mm512_maskz_loadu_epi8(m, p), v)));
+            num = 0;
+        }
+        acc = _mm512_sad_epu8(acc, z);
+        sum4 = _mm256_add_epi64(_mm512_castsi512_si256(acc),
+                                _mm512_extracti64x4_epi64(acc, 1));
+        sum = _mm_add_epi64(_mm256_castsi256_si128(sum4),
+                            _mm256_extracti128_si256(sum4, 1));
+        c += (unsigned)_mm_cvtsi128_si32(sum) +
+             (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+    return c;
+}
+
+#if LRG_VPOPCNT
+/* the 64-bit compare masks of eight vectors make up a vector of their own,
+   which VPOPCNTQ counts at once. this needs neither the byte counters nor
+   their PSADBW every 255 iterations, and it runs about half again as fast
+   as memcnt_avx512bw on data in the cache */
+__attribute__((target("avx512bw,avx512vpopcntdq"))) static size_t
+memcnt_avx512vpopcntdq(const void *ptr, int value, size_t num) {
+    const unsigned char *p = (const unsigned char *)ptr;
+    const __m512i v = _mm512_set1_epi8((char)value);
+    __m512i acc = _mm512_setzero_si512();
+    size_t c;
+#define LRG_CMP_MASK(i)                                                        \
+    __extension__(long long) _mm512_cmpeq_epi8_mask(                           \
+        _mm512_loadu_si512((const void *)(p + (i) * 64)), v)
+    while (num >= 512) {
+        acc = _mm512_add_epi64(
+            acc, _mm512_popcnt_epi64(_mm512_set_epi64(
+                     LRG_CMP_MASK(7), LRG_CMP_MASK(6), LRG_CMP_MASK(5),
+                     LRG_CMP_MASK(4), LRG_CMP_MASK(3), LRG_CMP_MASK(2),
+                     LRG_CMP_MASK(1), LRG_CMP_MASK(0))));
+        p += 512, num -= 512;
+    }
+#undef LRG_CMP_MASK
+    c = (size_t)_mm512_reduce_add_epi64(acc);
+    return num ? c + memcnt_avx512bw(p, value, num) : c;
+}
+#endif
+
+/* the memnchr kernels compare a vector at a time and count the matches in
+   the resulting bit mask, until the mask with the k-th match is found */
+
+__attribute__((target("sse2"))) static void *
+memnchr_sse2(const void *ptr, int value, size_t *count, size_t num) {
+    const char *p = (const char *)ptr;
+    const __m128i v = _mm_set1_epi8((char)value);
+    size_t k = *count;
+    while (num >= 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), v));
+        size_t c = (size_t)__builtin_popcount(m);
+        if (c >= k) {
+            while (--k)
+                m &= m - 1;
+            return (void *)(p + __builtin_ctz(m));
+        }
+        k -= c, p += 16, num -= 16;
+    }
+    *count = k;
+    return memnchr_generic(p, value, count, num);
+}
+
+__attribute__((target("avx2,popcnt"))) static void *
+memnchr_avx2(const void *ptr, int value, size_t *count, size_t num) {
+    const char *p = (const char *)ptr;
+    const __m256i v = _mm256_set1_epi8((char)value);
+    size_t k = *count;
+    while (num >= 32) {
+        unsigned m = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), v));
+        size_t c = (size_t)__builtin_popcount(m);
+        if (c >= k) {
+            while (--k)
+                m &= m - 1;
+            return (void *)(p + __builtin_ctz(m));
+        }
+        k -= c, p += 32, num -= 32;
+    }
+    *count = k;
+    return memnchr_generic(p, value, count, num);
+}
+
+__attribute__((target("avx512bw,popcnt"))) static void *
+memnchr_avx512bw(const void *ptr, int value, size_t *count, size_t num) {
+    const char *p = (const char *)ptr;
+    const __m512i v = _mm512_set1_epi8((char)value);
+    size_t k = *count;
+    while (num) {
+        size_t n = num < 64 ? num : 64, c;
+        __mmask64 l = n < 64 ? ((__mmask64)1 << n) - 1 : ~(__mmask64)0;
+        __mmask64 m = _mm512_mask_cmpeq_epi8_mask(
+            l, _mm512_maskz_loadu_epi8(l, p), v);
+        c = (size_t)__builtin_popcountll(m);
+        if (c >= k) {
+            while (--k)
+                m &= m - 1;
+            return (void *)(p + __builtin_ctzll(m));
+        }
+        k -= c, p += n, num -= n;
+    }
+    *count = k;
+    return NULL;
+}
+
+static size_t (*memcnt_kernel)(const void *, int, size_t) = memcnt_generic;
+static void *(*memnchr_kernel)(const void *, int, size_t *,
+                               size_t) = memnchr_generic;
+
+size_t memcnt(const void *ptr, int value, size_t num) {
+    return memcnt_kernel(ptr, value, num);
+}
+
+/* choose the memcnt and memnchr kernels for this CPU */
+static void lrg_memcnt_init(void) {
+    __builtin_cpu_init();
+#if LRG_VPOPCNT
+    if (__builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("popcnt")) {
+        memcnt_kernel = memcnt_avx512vpopcntdq,
+        memnchr_kernel = memnchr_avx512bw;
+        memcnt_name = "avx512vpopcntdq";
+    } else
+#endif
+    if (__builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("popcnt")) {
+        memcnt_kernel = memcnt_avx512bw, memnchr_kernel = memnchr_avx512bw;
+        memcnt_name = "avx512bw";
+    } else if (__builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("popcnt")) {
+        memcnt_kernel = memcnt_avx2, memnchr_kernel = memnchr_avx2;
+        memcnt_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        memcnt_kernel = memcnt_sse2, memnchr_kernel = memnchr_sse2;
+        memcnt_name = "sse2";
+    }
+}
+#endif
+
+/* finds the k-th byte equal to value within a buffer, where k = *count
+   (at least 1). returns a pointer to it, or NULL if there are fewer than k,
+   in which case *count is decreased by the number that there were */
+static void *memnchr(const void *ptr, int value, size_t *count, size_t num) {
+#if LRG_FAST_MEMCNT
+    if (*count > num) {
+        /* it cannot be in here, so just count */
+        *count -= memcnt(ptr, value, num);
+        return NULL;
+    }
+#endif
+#if LRG_SIMD_MEMCNT
+    return memnchr_kernel(ptr, value, count, num);
+#else
+    return memnchr_generic(ptr, value, count, num);
+#endif
+}
+
+/* like memnchr, but counts backwards from the end of the buffer, so that it
+   returns the *count-th last byte equal to value */
+static void *memrnchr(const void *ptr, int value, size_t *count, size_t num) {
+    const char *start = (const char *)ptr, *p = start + num;
+    size_t k = *count;
+#if LRG_FAST_MEMCNT
+    /* count the bytes in whole chunks until we reach the right one */
+    while (p - start > 256) {
+        size_t c = memcnt(p - 256, value, 256);
+        if (c >= k)
+            break;
+        k -= c, p -= 256;
+    }
+#endif
+    while (p > start)
+        if (*--p == (char)value && !--k)
+            return (void *)p;
+    *count = k;
+    return NULL;
+}
+
 /* ========================================================= */
 /*                     file reading code                     */
 /* ========================================================= */
 
-ALIGNAS(LRG_BUFFER_ALIGN) static char tmpbuf[LRG_BUFSIZE];
 static struct lrg_linerange st_linesbuf[LRG_LINEBUFSIZE];
 static struct lrg_linerange *linesbuf = st_linesbuf;
 /* number of line ranges */
 static size_t n_linesbuf = 0;
 /* capacity. if we run past, we need to reallocate the line range buffer */
 static size_t c_linesbuf = sizeof(st_linesbuf) / sizeof(st_linesbuf[0]);
+/* whether every range starts after the previous ones end, and otherwise how
+   many lines would be kept aside to read them all in one pass */
+static int ranges_ascending = 1;
+static linenum_t reorder_lines = 0;
+/* whether the ranges came from --ranges-from, so that they are merged */
+static int ranges_from_file = 0;
+/* the ranges of --ranges-from, as long as they are all plain ones and there
+   are no others: sorted and merged once read, so that they neither overlap
+   nor touch. intervals is NULL if the ranges are in linesbuf instead */
+static struct lrg_interval *intervals = NULL;
+static size_t n_intervals = 0, c_intervals = 0;
+/* the --ranges-from file, which stands for the ranges in error messages */
+static const char *ranges_fn;
+/* if not 0, some ranges count lines from the end (such as $-10), and this many
+   of the last lines of every file are needed. the ranges as given are kept in
+   ranges_given, and whether there are also lines counted from the start in
+   ranges_mixed */
+static linenum_t lines_from_end = 0;
+static struct lrg_linerange *ranges_given;
+static size_t n_ranges_given;
+static int ranges_mixed = 0;
+/* for --sample, how many lines to pick at random from every file (0 if not
+   sampling), and the state of the random number generator */
+static linenum_t sample_lines = 0;
+static unsigned long sample_state = 0;
 
 #if LRG_WIN32 /* implementation for Win32 */
 
 #define GET_FILE_FD _fileno
 #define FILEREF int
+#define lrg_off_t long
 #define FD_SEEK_SET(fd, n) (_lseek(fd, n, SEEK_SET) < 0)
-#define FD_SEEK_CUR(fd, n) (_lseek(fd, n, SEEK_CUR) < 0)
 
-INLINE int lrg_is_seekable(FILEREF fd) {
-    static struct _stat st;
+INLINE int lrg_is_seekable(FILEREF fd, lrg_off_t *size, size_t *blksize) {
+    struct _stat st;
+    *size = -1, *blksize = 0;
     if (_fstat(fd, &st))
         return fd != 0;
+    if (st.st_mode & _S_IFREG)
+        *size = st.st_size;
     return (st.st_mode & _S_IFREG) && _lseek(fd, 0, SEEK_SET) == 0 &&
            _lseek(fd, 1, SEEK_SET) == 1 && _lseek(fd, 0, SEEK_SET) == 0;
 }
@@ -553,7 +1206,12 @@ INLINE int lrg_fillbuf_file(char *buffer, size_t bufsize, FILEREF fd) {
 
 #elif LRG_DOS /* implementation for DOS */
 
-INLINE int lrg_is_seekable(FILE *f) {
+#define FILEREF FILE *
+#define lrg_off_t long
+#define FD_SEEK_SET(f, n) fseek(f, n, SEEK_SET)
+
+INLINE int lrg_is_seekable(FILE *f, lrg_off_t *size, size_t *blksize) {
+    *size = -1, *blksize = 0;
     return f != stdin;
 }
 
@@ -564,18 +1222,25 @@ INLINE int lrg_is_seekable(FILE *f) {
 
 #define GET_FILE_FD fileno
 #define FILEREF int
+#define lrg_off_t off_t
 #define FD_SEEK_SET(fd, n) (lseek(fd, n, SEEK_SET) < 0)
-#define FD_SEEK_CUR(fd, n) (lseek(fd, n, SEEK_CUR) < 0)
+#define FILE_SEEK_SET(f, n) fseeko(f, n, SEEK_SET)
 
-INLINE int lrg_is_seekable(FILEREF fd) {
-    static struct stat st;
+INLINE int lrg_is_seekable(FILEREF fd, lrg_off_t *size, size_t *blksize) {
+    struct stat st;
+    *size = -1, *blksize = 0;
     if (fstat(fd, &st))
         /* fallback: assume anything except stdin is seekable */
         return fd != STDIN_FILENO;
+    *blksize = st.st_blksize > 0 ? st.st_blksize : 0;
+    if (S_ISREG(st.st_mode)) {
+        /* regular files can always seek, and we read them with pread */
+        *size = st.st_size;
+        return 1;
+    }
     /* check file mode, and then try to seek */
-    return (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) &&
-           lseek(fd, 0, SEEK_SET) == 0 && lseek(fd, 1, SEEK_SET) == 1 &&
-           lseek(fd, 0, SEEK_SET) == 0;
+    return S_ISBLK(st.st_mode) && lseek(fd, 0, SEEK_SET) == 0 &&
+           lseek(fd, 1, SEEK_SET) == 1 && lseek(fd, 0, SEEK_SET) == 0;
 }
 
 INLINE void lrg_initbuffers(void) {}
@@ -585,6 +1250,16 @@ INLINE int lrg_fillbuf_file(char *buffer, size_t bufsize, FILEREF fd) {
     return read(fd, buffer, bufsize);
 }
 
+/* seekable files are read with pread at the offset we keep track of anyway,
+   so seeking takes no system call */
+#define USE_PREAD 1
+
+/* 0 for EOF, -1 for error */
+INLINE int lrg_fillbuf_at(char *buffer, size_t bufsize, FILEREF fd,
+                          lrg_off_t off) {
+    return pread(fd, buffer, bufsize, off);
+}
+
 #define lrg_fillbuf_pipe lrg_fillbuf_file
 /* since pipe/file impls are the same, just use one of them */
 #undef LRG_FILLBUF_MODE
@@ -593,6 +1268,8 @@ INLINE int lrg_fillbuf_file(char *buffer, size_t bufsize, FILEREF fd) {
 #else /* standard C implementation */
 
 #define FILEREF FILE *
+#define lrg_off_t long
+#define FD_SEEK_SET(f, n) fseek(f, n, SEEK_SET)
 /* use standard seek check */
 #define STDSEEKCH 1
 /* use standard read funcs */
@@ -600,8 +1277,16 @@ INLINE int lrg_fillbuf_file(char *buffer, size_t bufsize, FILEREF fd) {
 
 #endif
 
+/* seek within a temporary file to an lrg_off_t offset */
+#ifndef FILE_SEEK_SET
+#define FILE_SEEK_SET(f, n) fseek(f, n, SEEK_SET)
+#endif
+
 #if STDSEEKCH
-INLINE int lrg_is_seekable(FILE *f) { return !fseek(f, 0, SEEK_SET); }
+INLINE int lrg_is_seekable(FILE *f, lrg_off_t *size, size_t *blksize) {
+    *size = -1, *blksize = 0;
+    return !fseek(f, 0, SEEK_SET);
+}
 #endif
 
 #if STDREAD
@@ -639,10 +1324,6 @@ INLINE int lrg_fillbuf_pipe(char *buffer, size_t bufsize, FILE *file) {
 }
 #endif
 
-/* ========================================================= */
-/*               code scanning files for lines               */
-/* ========================================================= */
-
 #if LRG_POSIX_FADVISE && !(LRG_POSIX && _POSIX_VERSION >= 200112L)
 #undef LRG_POSIX_FADVISE
 #define LRG_POSIX_FADVISE 0
@@ -652,220 +1333,3809 @@ INLINE int lrg_fillbuf_pipe(char *buffer, size_t bufsize, FILE *file) {
 #include <fcntl.h>
 #endif
 
-#define JUMP_LINE(ln)                                                          \
-    do {                                                                       \
-        lrg_initbuffers();                                                     \
-        buf_next = buf_end;                                                    \
-        linenum = ln;                                                          \
-    } while (0);
-
-INLINE int lrg_processfile(const char *fn, FILE *f) {
-    int read_n, had_eol, can_seek, show_this_linenum = show_linenums;
-    char *buf_prev, *buf_next, *buf_end = NULL;
-    struct lrg_linerange range;
-    linenum_t linenum, eof_at = LINENUM_MAX;
-    size_t range_i;
+#if LRG_OPEN_AHEAD && !LRG_POSIX_FADVISE
+#undef LRG_OPEN_AHEAD
+#define LRG_OPEN_AHEAD 0
+#endif
 
-#ifdef GET_FILE_FD
-    int fd = GET_FILE_FD(f);
-#define READ_BUFFER_FILE(buf, sz) lrg_fillbuf_file(buf, sz, fd)
-#define READ_BUFFER_PIPE(buf, sz) lrg_fillbuf_pipe(buf, sz, fd)
-#define FILE_SEEK_SET(n) FD_SEEK_SET(fd, n)
-#define FILE_SEEK_CUR(n) FD_SEEK_CUR(fd, n)
-    can_seek = lrg_is_seekable(fd);
-#else
-#define READ_BUFFER_FILE(buf, sz) lrg_fillbuf_file(buf, sz, f)
-#define READ_BUFFER_PIPE(buf, sz) lrg_fillbuf_pipe(buf, sz, f)
-#define FILE_SEEK_SET(n) fseek(f, n, SEEK_SET)
-#define FILE_SEEK_CUR(n) fseek(f, n, SEEK_CUR)
-    can_seek = lrg_is_seekable(f);
+#if LRG_MMAP && !LRG_POSIX
+#undef LRG_MMAP
+#define LRG_MMAP 0
 #endif
 
-#if LRG_FILLBUF_MODE == 0
-#define READ_BUFFER(buf, sz) READ_BUFFER_FILE(buf, sz)
-#elif LRG_FILLBUF_MODE == 1
-#define READ_BUFFER(buf, sz) READ_BUFFER_PIPE(buf, sz)
-#undef LRG_BACKWARD_SCAN
-#define LRG_BACKWARD_SCAN 0
-#else
-    /* piece of cake for the branch predictor */
-#define READ_BUFFER(buf, sz)                                                   \
-    (can_seek ? (READ_BUFFER_FILE(buf, sz)) : (READ_BUFFER_PIPE(buf, sz)))
+#if LRG_MMAP
+#include <sys/mman.h>
+
+/* map every file that can be mapped (--mmap) */
+static int map_input = 0;
 #endif
 
-#if LRG_POSIX_FADVISE
-    if (can_seek)
-        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#if LRG_IO_URING && !(LRG_POSIX && defined(__linux__) && defined(__GNUC__))
+#undef LRG_IO_URING
+#define LRG_IO_URING 0
 #endif
-    JUMP_LINE(1);
-    read_n = 0;
 
-    for (range_i = 0; range_i < n_linesbuf; ++range_i) {
-        range = linesbuf[range_i];
+#if LRG_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* an io_uring with a fixed set of read buffers. the buffers are submitted
+   and handed to the scanner in a fixed cyclic order */
+struct lrg_uring {
+    int fd, file;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    /* number of SQEs not yet given to the kernel */
+    unsigned to_submit;
+    struct iovec iov[LRG_IO_URING_DEPTH];
+    lrg_off_t offs[LRG_IO_URING_DEPTH];
+    /* result of each read; LRG_URING_PENDING while in flight */
+    int res[LRG_IO_URING_DEPTH];
+    /* next buffer to hand out, number of buffers submitted but not yet
+       handed out */
+    unsigned head, queued;
+    /* offset of the next read to submit */
+    lrg_off_t next_off;
+};
 
-        if (UNLIKELY(range.first > range.last))
-            continue;
+#define LRG_URING_PENDING INT_MIN
 
-        if (UNLIKELY(range.first > eof_at)) {
-            /* we already know this won't work */
-            if (warn_noline)
-                lrg_eof_before(fn, range.first, eof_at);
-            if (error_on_eof)
-                return 0;
-            continue;
-        }
+static int lrg_uring_enter(struct lrg_uring *r, unsigned min_complete) {
+    long n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    r->to_submit -= n;
+    return 0;
+}
 
-        /* do we need to go back? */
-        if (UNLIKELY(range.first < linenum)) {
-            if (!can_seek) {
-                /* this is not a seekable file! cannot rewind */
-                lrg_no_rewind(fn, range.text);
-                return 1;
-            }
+/* queue a read into the next free buffer */
+static void lrg_uring_queue(struct lrg_uring *r) {
+    unsigned i = (r->head + r->queued++) % LRG_IO_URING_DEPTH;
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = r->file;
+    sqe->off = r->offs[i] = r->next_off;
+    sqe->addr = (unsigned long)&r->iov[i];
+    sqe->len = 1;
+    sqe->user_data = i;
+    r->res[i] = LRG_URING_PENDING;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->next_off += r->iov[i].iov_len;
+    ++r->to_submit;
+}
 
-#if LRG_BACKWARD_SCAN
-            if (range.first > LRG_BACKWARD_SCAN_THRESHOLD &&
-                range.first > linenum / 2) {
-#if LRG_POSIX_FADVISE
-                if (can_seek)
-                    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
-#endif
-                linenum -= memcnt(tmpbuf, '\n', buf_next - tmpbuf);
-                /* scan backwards until we reach the correct previous line.
-                   can_seek assumed to be true and range.first > 1 */
-                while (linenum >= range.first) {
-                    if (FILE_SEEK_CUR(-(long)(read_n + sizeof(tmpbuf))))
-                        goto jump_backwards;
-                    read_n = READ_BUFFER(tmpbuf, sizeof(tmpbuf));
-                    if (read_n < sizeof(tmpbuf))
-                        goto read_error;
-                    linenum -= memcnt(tmpbuf, '\n', read_n);
-                }
-                /* no jump. the buffer is already full of what we need */
-                buf_next = tmpbuf, buf_end = tmpbuf + read_n;
-            } else
-            jump_backwards: /* goto abuse. this is somehow allowed! */
-#endif
-            {
-                if (FILE_SEEK_SET(0)) {
-                    lrg_perror(fn, OPER_SEEK);
-                    lrg_no_rewind(fn, range.text);
-                    return 1;
-                }
-#if LRG_POSIX_FADVISE
-                if (can_seek)
-                    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
-#endif
-                JUMP_LINE(1);
-            }
+/* submit anything queued and reap completions until buffer i is done */
+static int lrg_uring_wait(struct lrg_uring *r, unsigned i) {
+    for (;;) {
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            r->res[cqe->user_data] = cqe->res;
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
         }
+        if (r->res[i] != LRG_URING_PENDING)
+            return r->to_submit ? lrg_uring_enter(r, 0) : 0;
+        if (lrg_uring_enter(r, 1))
+            return -1;
+    }
+}
 
-        for (;;) {
-            /* have to read more? */
-            if (buf_next == buf_end) {
-                do {
-                    read_n = READ_BUFFER(tmpbuf, sizeof(tmpbuf));
-                    if (UNLIKELY(read_n <= 0))
-                        goto read_error;
-#if LRG_FAST_MEMCNT
-                    if (linenum < range.first - 1) {
-                        /* count the number of newlines with memcnt. if we find
-                           the line we're looking for, start looking for it;
-                           else skip the entire block. e.g. if we are still
-                           2000 lines away and the buffer has 1000 bytes,
-                           obviously this data will not have the line we're
-                           looking for. thus, we'll just count the number of
-                           newlines and fill the buffer with new data. */
-                        linenum_t linenum_eob = linenum
-                                            + memcnt(tmpbuf, '\n', read_n);
-                        if (linenum_eob < range.first) {
-                            linenum = linenum_eob;
-                            continue;
-                        }
-                    }
-#endif
-                    buf_next = tmpbuf, buf_end = tmpbuf + read_n;
-                } while (0);
-            }
+/* wait for every queued read to complete and forget about them */
+static int lrg_uring_drain(struct lrg_uring *r) {
+    while (r->queued) {
+        if (lrg_uring_wait(r, r->head))
+            return -1;
+        r->head = (r->head + 1) % LRG_IO_URING_DEPTH, --r->queued;
+    }
+    r->head = 0;
+    return 0;
+}
 
-            buf_prev = buf_next;
-            buf_next = memchr(buf_next, '\n', buf_end - buf_next);
-            had_eol = buf_next != NULL;
-            buf_next = had_eol ? buf_next + 1 : buf_end;
+static void lrg_uring_close(struct lrg_uring *r) {
+    unsigned i;
+    lrg_uring_drain(r);
+    for (i = 0; i < LRG_IO_URING_DEPTH; ++i)
+        lrg_free(r->iov[i].iov_base);
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    lrg_free(r);
+}
 
-            if (linenum < range.first) {
-                linenum += had_eol;
-                continue;
-            }
+/* set up a ring for reading the given file. NULL if not possible */
+static struct lrg_uring *lrg_uring_open(int file, size_t bufsize) {
+    struct io_uring_params p;
+    struct lrg_uring *r;
+    unsigned i;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r = lrg_malloc(sizeof(*r));
+    if (!r)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+    r->file = file;
+    r->fd = syscall(__NR_io_uring_setup, LRG_IO_URING_DEPTH, &p);
+    if (r->fd < 0) {
+        lrg_free(r);
+        return NULL;
+    }
 
-            if (show_this_linenum) /* show one line number and then not again */
-                printf(LINE_DISPLAY_FMT, linenum), show_this_linenum = 0;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail_sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail_cq;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    sq = r->sq_ptr, cq = r->cq_ptr;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    for (i = 0; i < LRG_IO_URING_DEPTH; ++i) {
+        /* page-aligned buffers */
+        if (!(r->iov[i].iov_base = lrg_malloc_aligned(bufsize))) {
+            lrg_uring_close(r);
+            return NULL;
+        }
+        r->iov[i].iov_len = bufsize;
+    }
+    return r;
+
+fail_sqes:
+    r->sqes = NULL;
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+fail_cq:
+    munmap(r->sq_ptr, r->sq_len);
+fail_sq:
+    close(r->fd);
+    lrg_free(r);
+    return NULL;
+}
 
-            /* by using fwrite this way, it returns 1 for successful write */
-            if (UNLIKELY(!fwrite(buf_prev, buf_next - buf_prev, 1, stdout))) {
-                lrg_broken_pipe();
-                return 1;
-            }
+/* like lrg_input_read, with pos and size taken from the input. reads are
+   kept in flight for every buffer not currently used by the scanner */
+static int lrg_uring_read(struct lrg_uring *r, char **data, lrg_off_t *pos,
+                          lrg_off_t size) {
+    unsigned i;
+    int res;
+
+    /* the buffer handed out last time is free again */
+    while (r->queued < LRG_IO_URING_DEPTH && (size < 0 || r->next_off < size))
+        lrg_uring_queue(r);
+    if (!r->queued)
+        return 0;
+
+    i = r->head;
+    if (lrg_uring_wait(r, i))
+        return -1;
+    r->head = (r->head + 1) % LRG_IO_URING_DEPTH, --r->queued;
+    res = r->res[i];
+    if (UNLIKELY(res <= 0)) {
+        lrg_uring_drain(r);
+        r->next_off = *pos;
+        if (res < 0)
+            errno = -res, res = -1;
+        return res;
+    }
 
-            if (had_eol) {
+    *pos = r->offs[i] + res;
+    if (UNLIKELY((size_t)res < r->iov[i].iov_len)) {
+        /* short read, the reads after this one are at the wrong offsets */
+        lrg_uring_drain(r);
+        r->next_off = *pos;
+    }
+    *data = r->iov[i].iov_base;
+    return res;
+}
+
+/* seek by restarting the reads from the new offset */
+static int lrg_uring_seek(struct lrg_uring *r, lrg_off_t off) {
+    if (lrg_uring_drain(r))
+        return -1;
+    r->next_off = off;
+    return 0;
+}
+#endif
+
+#if LRG_THREADS && !(LRG_POSIX && defined(_POSIX_THREADS) && _POSIX_THREADS > 0)
+#undef LRG_THREADS
+#define LRG_THREADS 0
+#endif
+
+#if LRG_THREADS
+#include <pthread.h>
+#endif
+
+#if LRG_PARALLEL_FILES && !LRG_THREADS
+#undef LRG_PARALLEL_FILES
+#define LRG_PARALLEL_FILES 0
+#endif
+
+#if LRG_ZERO_COPY && !(LRG_POSIX && defined(__linux__) && defined(_GNU_SOURCE))
+#undef LRG_ZERO_COPY
+#define LRG_ZERO_COPY 0
+#endif
+
+#if LRG_ZERO_COPY
+/* how data can be moved to stdout within the kernel, if at all */
+#define LRG_ZC_NONE 0
+#define LRG_ZC_COPY 1   /* copy_file_range */
+#define LRG_ZC_SPLICE 2 /* splice */
+static int zero_copy_out = LRG_ZC_NONE;
+
+/* the most we ask the kernel to move with one call */
+#define LRG_ZC_CHUNK (1L << 30)
+
+static void lrg_zero_copy_init(void) {
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st))
+        return;
+    if (S_ISREG(st.st_mode))
+        zero_copy_out = LRG_ZC_COPY;
+    else if (S_ISFIFO(st.st_mode))
+        zero_copy_out = LRG_ZC_SPLICE;
+}
+
+/* copy the bytes of fd from start up to end (or EOF if end < 0) to stdout.
+   returns the number of bytes copied; if that is short of end, errno tells
+   why (0 if the file ended) */
+static lrg_off_t lrg_zero_copy(int fd, lrg_off_t start, lrg_off_t end) {
+    loff_t off = start;
+    while (end < 0 || off < end) {
+        size_t len = end < 0 || end - off > LRG_ZC_CHUNK ? (size_t)LRG_ZC_CHUNK
+                                                         : (size_t)(end - off);
+        ssize_t n = zero_copy_out == LRG_ZC_SPLICE
+                        ? splice(fd, &off, STDOUT_FILENO, NULL, len, 0)
+                        : copy_file_range(fd, &off, STDOUT_FILENO, NULL, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (!n)
+                errno = 0;
+            break;
+        }
+    }
+    return off - start;
+}
+
+/* whether lrg_zero_copy failed only because the kernel cannot do it here */
+INLINE int lrg_zero_copy_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EBADF ||
+           err == EOPNOTSUPP;
+}
+#endif
+
+#if LRG_WRITEV && !LRG_POSIX
+#undef LRG_WRITEV
+#define LRG_WRITEV 0
+#endif
+
+#if LRG_WRITEV
+#include <sys/uio.h>
+typedef struct iovec lrg_iovec_t;
+#else
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} lrg_iovec_t;
+#endif
+
+/* output is gathered as a list of pieces, each either copied into the output
+   buffer or left where it is, and written out at once when either is full.
+   pieces that were left where they are must stay there until the next
+   flush, so the input flushes before it reuses a buffer */
+static char out_static[LRG_OUT_BUFSIZE];
+static LRG_THREAD_LOCAL char *out_buf = out_static;
+static LRG_THREAD_LOCAL lrg_iovec_t out_vec[LRG_OUT_IOVECS];
+/* the bytes used in out_buf, the pieces in out_vec and whether any of them
+   were left where they are */
+static LRG_THREAD_LOCAL size_t out_len = 0;
+static LRG_THREAD_LOCAL int out_n = 0, out_held = 0;
+/* errno of a flush whose failure could not be reported right away */
+static LRG_THREAD_LOCAL int out_error = 0;
+
+#if LRG_PARALLEL_FILES
+/* the output of a file processed on a worker thread, kept until it is its
+   turn to be written out: the first LRG_REORDER_MEMORY bytes in memory and
+   the rest in a temporary file */
+struct lrg_sink {
+    char *mem;
+    size_t len;
+    FILE *spill;
+};
+
+/* where the output of this thread goes instead of stdout, if anywhere */
+static LRG_THREAD_LOCAL struct lrg_sink *out_sink = NULL;
+
+/* keep n bytes of output in a sink. 0 if OK, else errno tells why */
+static int lrg_sink_write(struct lrg_sink *k, const char *p, size_t n) {
+    size_t part;
+    if (k->len < LRG_REORDER_MEMORY) {
+        if (!k->mem && !(k->mem = lrg_malloc(LRG_REORDER_MEMORY))) {
+            errno = ENOMEM;
+            return 1;
+        }
+        part = LRG_REORDER_MEMORY - k->len;
+        if (part > n)
+            part = n;
+        memcpy(k->mem + k->len, p, part);
+        k->len += part, p += part, n -= part;
+    }
+    if (n && ((!k->spill && !(k->spill = tmpfile())) ||
+              !fwrite(p, n, 1, k->spill)))
+        return 1;
+    return 0;
+}
+
+static void lrg_sink_free(struct lrg_sink *k) {
+    lrg_free(k->mem);
+    if (k->spill)
+        fclose(k->spill);
+    k->mem = NULL, k->len = 0, k->spill = NULL;
+}
+#endif
+
+/* whether this thread is processing a file of its own among several, with
+   its output kept aside until it is its turn */
+INLINE int lrg_on_worker(void) {
+#if LRG_PARALLEL_FILES
+    return out_sink != NULL;
+#else
+    return 0;
+#endif
+}
+
+/* write n pieces of output to stdout. 0 if OK, else errno tells why */
+static int lrg_out_pieces(lrg_iovec_t *v, int n) {
+#if LRG_PARALLEL_FILES
+    if (out_sink) {
+        for (; n; ++v, --n)
+            if (lrg_sink_write(out_sink, v->iov_base, v->iov_len))
+                return 1;
+        return 0;
+    }
+#endif
+#if LRG_WRITEV
+    while (n) {
+        ssize_t w = writev(STDOUT_FILENO, v, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            if (!w)
+                errno = EIO;
+            return 1;
+        }
+        /* skip what was written, which may end in the middle of a piece */
+        for (; n && (size_t)w >= v->iov_len; ++v, --n)
+            w -= v->iov_len;
+        if (n)
+            v->iov_base = (char *)v->iov_base + w, v->iov_len -= w;
+    }
+#else
+    for (; n; ++v, --n)
+        if (!fwrite(v->iov_base, v->iov_len, 1, stdout))
+            return 1;
+#endif
+    return 0;
+}
+
+#if LRG_THREADS
+/* write output on a separate thread (--threads-out) */
+static int threads_out = 0;
+
+/* a writer thread writing out full output buffers in the order they were
+   filled, so that the scanner can go on reading while a slow reader of the
+   output catches up. everything is copied into the buffers, since the input
+   may reuse its own before the writer gets to them */
+struct lrg_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* signaled whenever a buffer is queued or written */
+    pthread_cond_t cond;
+    char *bufs[LRG_WRITER_BUFFERS];
+    size_t lens[LRG_WRITER_BUFFERS];
+    /* next buffer to write, number of buffers queued including the one being
+       written. the scanner fills the buffer after the queued ones */
+    unsigned head, queued;
+    /* errno of the first failed write. anything after it is thrown away */
+    int err;
+    /* set to ask the writer thread to stop once everything is written */
+    int stop;
+};
+
+static LRG_THREAD_LOCAL struct lrg_writer *out_writer = NULL;
+
+static void *lrg_writer_main(void *arg) {
+    struct lrg_writer *w = arg;
+    lrg_iovec_t v;
+    int err;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->queued && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->queued)
+            break;
+        v.iov_base = w->bufs[w->head], v.iov_len = w->lens[w->head];
+        err = w->err;
+        pthread_mutex_unlock(&w->lock);
+
+        if (!err && lrg_out_pieces(&v, 1))
+            err = errno;
+
+        pthread_mutex_lock(&w->lock);
+        w->err = err;
+        w->head = (w->head + 1) % LRG_WRITER_BUFFERS, --w->queued;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void lrg_writer_free(struct lrg_writer *w) {
+    unsigned i;
+    for (i = 0; i < LRG_WRITER_BUFFERS; ++i)
+        lrg_free(w->bufs[i]);
+    lrg_free(w);
+}
+
+/* start a writer thread and have the output go through it. NULL if not
+   possible, in which case the output is written as usual */
+static struct lrg_writer *lrg_writer_open(void) {
+    struct lrg_writer *w = lrg_malloc(sizeof(*w));
+    unsigned i;
+    if (!w)
+        return NULL;
+    memset(w, 0, sizeof(*w));
+    for (i = 0; i < LRG_WRITER_BUFFERS; ++i)
+        if (!(w->bufs[i] = lrg_malloc(LRG_OUT_BUFSIZE)))
+            goto fail_alloc;
+    if (pthread_mutex_init(&w->lock, NULL))
+        goto fail_alloc;
+    if (pthread_cond_init(&w->cond, NULL))
+        goto fail_cond;
+    if (pthread_create(&w->thread, NULL, &lrg_writer_main, w))
+        goto fail_thread;
+    out_buf = w->bufs[0];
+    return w;
+
+fail_thread:
+    pthread_cond_destroy(&w->cond);
+fail_cond:
+    pthread_mutex_destroy(&w->lock);
+fail_alloc:
+    lrg_writer_free(w);
+    return NULL;
+}
+
+/* queue len bytes of the buffer being filled and move on to the next one,
+   waiting only if every buffer is queued. 0 if OK, else errno tells why */
+static int lrg_writer_queue(struct lrg_writer *w, size_t len) {
+    int err;
+    pthread_mutex_lock(&w->lock);
+    if (len) {
+        w->lens[(w->head + w->queued++) % LRG_WRITER_BUFFERS] = len;
+        pthread_cond_broadcast(&w->cond);
+        while (w->queued == LRG_WRITER_BUFFERS)
+            pthread_cond_wait(&w->cond, &w->lock);
+        out_buf = w->bufs[(w->head + w->queued) % LRG_WRITER_BUFFERS];
+    }
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+    if (err)
+        errno = err;
+    return err != 0;
+}
+
+/* wait until everything queued has been written. 0 if OK */
+static int lrg_writer_sync(struct lrg_writer *w) {
+    int err;
+    pthread_mutex_lock(&w->lock);
+    while (w->queued)
+        pthread_cond_wait(&w->cond, &w->lock);
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+    if (err)
+        errno = err;
+    return err != 0;
+}
+
+/* write out everything queued and stop the thread. 0 if OK */
+static int lrg_writer_close(struct lrg_writer *w) {
+    int err;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    err = w->err;
+    lrg_writer_free(w);
+    if (err)
+        errno = err;
+    return err != 0;
+}
+#endif
+
+/* write out everything gathered so far. 0 if OK, else errno tells why */
+static int lrg_out_flush(void) {
+    int n = out_n;
+#if LRG_THREADS
+    size_t len = out_len;
+#endif
+    out_len = 0, out_n = 0, out_held = 0;
+    if (UNLIKELY(out_error)) {
+        errno = out_error;
+        return 1;
+    }
+#if LRG_THREADS
+    if (out_writer)
+        return lrg_writer_queue(out_writer, len);
+#endif
+    return lrg_out_pieces(out_vec, n);
+}
+
+/* like lrg_out_flush, but also waits until the output has been written, for
+   when something else is about to write to stdout or wait. 0 if OK */
+static int lrg_out_sync(void) {
+    if (lrg_out_flush())
+        return 1;
+#if LRG_THREADS
+    if (out_writer && lrg_writer_sync(out_writer))
+        return 1;
+#endif
+#if !LRG_WRITEV
+    /* without writev, the output still sits in the buffer of stdout */
+    if (!lrg_on_worker() && fflush(stdout))
+        return 1;
+#endif
+    return 0;
+}
+
+/* write out everything and stop the writer thread, if any. 0 if OK */
+static int lrg_out_finish(void) {
+    int err = lrg_out_flush();
+#if LRG_THREADS
+    if (out_writer) {
+        if (lrg_writer_close(out_writer))
+            err = 1;
+        out_writer = NULL, out_buf = out_static;
+    }
+#endif
+#if !LRG_WRITEV
+    if (fflush(stdout))
+        err = 1;
+#endif
+    return err;
+}
+
+/* flush the output before the input reuses a buffer that it may point to.
+   an error is reported by the next flush */
+INLINE void lrg_out_release(void) {
+    if (out_held && lrg_out_flush())
+        out_error = errno;
+}
+
+/* output n bytes from p, which must stay there until the next flush */
+static int lrg_out_hold(const char *p, size_t n) {
+    if (out_n == LRG_OUT_IOVECS && lrg_out_flush())
+        return 1;
+    out_vec[out_n].iov_base = (char *)p, out_vec[out_n++].iov_len = n;
+    out_held = 1;
+    return 0;
+}
+
+/* copy n bytes from p into the output buffer, which must have room */
+static int lrg_out_append(const char *p, size_t n) {
+    lrg_iovec_t *v = &out_vec[out_n ? out_n - 1 : 0];
+    if (!out_n || (char *)v->iov_base + v->iov_len != out_buf + out_len) {
+        /* not right after the previous piece, so start a new one */
+        if (out_n == LRG_OUT_IOVECS && lrg_out_flush())
+            return 1;
+        v = &out_vec[out_n++];
+        v->iov_base = out_buf + out_len, v->iov_len = 0;
+    }
+    memcpy(out_buf + out_len, p, n);
+    out_len += n, v->iov_len += n;
+    return 0;
+}
+
+/* output n bytes from p by copying them. 0 if OK */
+static int lrg_out_write(const char *p, size_t n) {
+    size_t part;
+    if (n > LRG_OUT_BUFSIZE - out_len) {
+#if LRG_THREADS
+        if (out_writer) {
+            /* the writer thread only gets copies, so fill up buffers */
+            while (n > (part = LRG_OUT_BUFSIZE - out_len)) {
+                if ((part && lrg_out_append(p, part)) || lrg_out_flush())
+                    return 1;
+                p += part, n -= part;
+            }
+            return lrg_out_append(p, n);
+        }
+#endif
+        if (lrg_out_flush())
+            return 1;
+        /* too long to copy at all, so write it from where it is */
+        if (n > LRG_OUT_BUFSIZE)
+            return lrg_out_hold(p, n) || lrg_out_flush();
+    }
+    (void)part;
+    return lrg_out_append(p, n);
+}
+
+/* output n bytes read from the input, which stay in its buffer until it
+   reads or seeks again. 0 if OK */
+INLINE int lrg_out_input(const char *p, size_t n) {
+#if LRG_THREADS
+    if (out_writer)
+        return lrg_out_write(p, n);
+#endif
+    return n >= LRG_OUT_DIRECT ? lrg_out_hold(p, n) : lrg_out_write(p, n);
+}
+
+/* output a line number for -l. 0 if OK */
+static int lrg_out_linenum(linenum_t line) {
+    static const char digits[] = "00010203040506070809"
+                                 "10111213141516171819"
+                                 "20212223242526272829"
+                                 "30313233343536373839"
+                                 "40414243444546474849"
+                                 "50515253545556575859"
+                                 "60616263646566676869"
+                                 "70717273747576777879"
+                                 "80818283848586878889"
+                                 "90919293949596979899";
+    char tmp[sizeof(LINE_DISPLAY_BEFORE) + LINE_DISPLAY_WIDTH +
+             sizeof(linenum_t) * CHAR_BIT / 3 + sizeof(LINE_DISPLAY_AFTER)];
+    char *end = tmp + sizeof(tmp) - sizeof(LINE_DISPLAY_AFTER), *p = end;
+    unsigned i;
+
+    /* from the last digit, two at a time */
+    memcpy(end, LINE_DISPLAY_AFTER, sizeof(LINE_DISPLAY_AFTER) - 1);
+    for (; line >= 100; line /= 100) {
+        i = (unsigned)(line % 100) * 2;
+        *--p = digits[i + 1], *--p = digits[i];
+    }
+    i = (unsigned)line * 2;
+    *--p = digits[i + 1];
+    if (line >= 10)
+        *--p = digits[i];
+    while (end - p < LINE_DISPLAY_WIDTH)
+        *--p = ' ';
+    p -= sizeof(LINE_DISPLAY_BEFORE) - 1;
+    memcpy(p, LINE_DISPLAY_BEFORE, sizeof(LINE_DISPLAY_BEFORE) - 1);
+    return lrg_out_write(p, end + sizeof(LINE_DISPLAY_AFTER) - 1 - p);
+}
+
+#if LRG_FILLBUF_MODE == 1
+#undef LRG_BACKWARD_SCAN
+#define LRG_BACKWARD_SCAN 0
+#endif
+
+#if LRG_INDEX && !LRG_POSIX
+#undef LRG_INDEX
+#define LRG_INDEX 0
+#endif
+
+#if LRG_INDEX
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* use indexes of files when they are found (disabled by --no-index) */
+static int use_index = 1;
+
+/* an index file starts with a header of 8-byte little-endian fields:
+
+      0  magic and version, LRG_INDEX_MAGIC
+      8  interval: number of lines between two offsets
+     16  length of the indexed part of the file in bytes
+     24  number of newlines in that part
+     32  number of offsets (n); offset j (1 <= j <= n) is that of line
+         1 + j * interval. line 1 is at offset 0, which is not stored
+     40  device and inode of the indexed file
+     56  its modification time in seconds and nanoseconds
+     72  its status change time in seconds and nanoseconds
+     88  hash of samples of the indexed part
+     96  hash of the last LRG_INDEX_TAIL bytes of the indexed part
+
+   an index is only used to read a file that has not changed since, which
+   the size and the times tell. if the file is longer than the indexed part,
+   --build-index takes it to have only been appended to, as long as the
+   hashes agree, and only scans what was appended. the hashes only sample
+   the indexed part, so an edit inside it is not always caught: only appends
+   are safe. reading the file before that does not use the index, since the
+   times cannot tell an append from an edit.
+
+   after it comes a table with an entry for every LRG_INDEX_GROUP offsets
+   (n / LRG_INDEX_GROUP + 1 entries), each giving offset j = g * LRG_INDEX_GROUP
+   and the position of the delta of offset j + 1 in the deltas that follow.
+   the deltas (offset j - offset j-1) are stored as LEB128 varints. nothing in
+   the file depends on where it is loaded, so it is used as mapped */
+#define LRG_INDEX_MAGIC "LRGIDX\0\3"
+#define LRG_INDEX_HEADER 104
+
+/* nanoseconds of the times of a file, where struct stat has them. without
+   them, an edit in the same second as the index is only caught by the hashes */
+#if _POSIX_VERSION >= 200809L
+#define LRG_MTIME_NSEC(st) ((linenum_t)(st)->st_mtim.tv_nsec)
+#define LRG_CTIME_NSEC(st) ((linenum_t)(st)->st_ctim.tv_nsec)
+#else
+#define LRG_MTIME_NSEC(st) 0
+#define LRG_CTIME_NSEC(st) 0
+#endif
+#define LRG_INDEX_GROUP 256
+
+/* a loaded index, mapped from its file */
+struct lrg_index {
+    const unsigned char *data;
+    size_t len;
+    linenum_t interval, count;
+    /* length of the indexed part of the file, number of newlines in it */
+    lrg_off_t covered;
+    linenum_t newlines;
+    /* the group table and the deltas */
+    const unsigned char *groups, *deltas;
+};
+
+static void lrg_put64(unsigned char *p, linenum_t v) {
+    int i;
+    for (i = 0; i < 8; ++i, v >>= 4, v >>= 4)
+        p[i] = (unsigned char)(v & 255);
+}
+
+static linenum_t lrg_get64(const unsigned char *p) {
+    linenum_t v = 0;
+    int i;
+    for (i = 7; i >= 0; --i)
+        v = (v << 4 << 4) | p[i];
+    return v;
+}
+
+/* FNV-1a (64-bit, or 32-bit if linenum_t is) */
+#if LRG_C99
+#define LRG_HASH_BASIS 14695981039346656037ULL
+#define LRG_HASH_PRIME 1099511628211ULL
+#else
+#define LRG_HASH_BASIS 2166136261UL
+#define LRG_HASH_PRIME 16777619UL
+#endif
+
+static linenum_t lrg_hash(linenum_t h, const unsigned char *p, size_t n) {
+    while (n--)
+        h = (h ^ *p++) * LRG_HASH_PRIME;
+    return h;
+}
+
+/* number and size of the samples hashed to tell whether a file has changed */
+#define LRG_INDEX_SAMPLES 16
+#define LRG_INDEX_SAMPLE 256
+/* number of bytes at the end of the indexed part that are hashed */
+#define LRG_INDEX_TAIL 4096
+
+/* hash n bytes of a file at off into *hash. 0 if OK */
+static int lrg_index_hash(int fd, lrg_off_t off, size_t n, linenum_t *hash) {
+    unsigned char buf[LRG_INDEX_SAMPLE];
+    size_t got, k;
+    ssize_t r;
+
+    for (; n; n -= k, off += k) {
+        k = n < sizeof(buf) ? n : sizeof(buf);
+        for (got = 0; got < k; got += r) {
+            r = pread(fd, buf + got, k - got, off + got);
+            if (r < 0 && errno == EINTR)
+                r = 0;
+            else if (r <= 0)
+                return -1;
+        }
+        *hash = lrg_hash(*hash, buf, k);
+    }
+    return 0;
+}
+
+/* hash evenly spaced samples of the first len bytes of a file, and the last
+   LRG_INDEX_TAIL of them. 0 if OK */
+static int lrg_index_sample(int fd, lrg_off_t len, linenum_t *hash,
+                            linenum_t *tail) {
+    size_t n = len < LRG_INDEX_SAMPLE ? (size_t)len : LRG_INDEX_SAMPLE;
+    lrg_off_t step = (len - n) / (LRG_INDEX_SAMPLES - 1);
+    int i;
+
+    *hash = *tail = LRG_HASH_BASIS;
+    for (i = 0; i < LRG_INDEX_SAMPLES; ++i)
+        if (lrg_index_hash(fd, step * i, n, hash))
+            return -1;
+    n = len < LRG_INDEX_TAIL ? (size_t)len : LRG_INDEX_TAIL;
+    return lrg_index_hash(fd, len - n, n, tail);
+}
+
+/* the cache directory of indexes is dir followed by *sub: $LRG_INDEX_DIR,
+   $XDG_CACHE_HOME/lrg or ~/.cache/lrg. NULL if there is none */
+static const char *lrg_index_dir(const char **sub) {
+    const char *dir;
+    *sub = "";
+    if ((dir = getenv("LRG_INDEX_DIR")) && *dir)
+        return dir;
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        return *sub = "/lrg", dir;
+    if ((dir = getenv("HOME")) && *dir)
+        return *sub = "/.cache/lrg", dir;
+    return NULL;
+}
+
+/* whether to look for indexes in the cache directory. lrg_index_init clears
+   it if there is no such directory, so that inputs do not each try to open
+   an index there */
+static int index_cache = 1;
+
+static void lrg_index_init(void) {
+    const char *dir, *sub;
+    char *path;
+    struct stat st;
+    if (!(dir = lrg_index_dir(&sub)) ||
+        !(path = lrg_malloc(strlen(dir) + strlen(sub) + 1))) {
+        index_cache = 0;
+        return;
+    }
+    sprintf(path, "%s%s", dir, sub);
+    index_cache = !stat(path, &st) && S_ISDIR(st.st_mode);
+    lrg_free(path);
+}
+
+/* the path of the index of a file. with cache = 0, next to the file (if we
+   know its name), and with cache = 1, in the cache directory, named after
+   the device and inode of the file. NULL if there is no such path */
+static char *lrg_index_path(const char *fn, const struct stat *st, int cache) {
+    const char *dir, *sub;
+    char *path, name[4 * (sizeof(dev_t) + sizeof(ino_t)) + 2],
+        *q = name + sizeof(name);
+    dev_t dev = st->st_dev;
+    ino_t ino = st->st_ino;
+    if (!cache) {
+        if (!fn)
+            return NULL;
+        path = lrg_malloc(strlen(fn) + sizeof(".lrgidx"));
+        if (path)
+            sprintf(path, "%s.lrgidx", fn);
+        return path;
+    }
+    if (!(dir = lrg_index_dir(&sub)))
+        return NULL;
+    /* the device and inode in hexadecimal, whatever the size of their types.
+       the digits are written from the end */
+    *--q = 0;
+    do
+        *--q = "0123456789abcdef"[ino & 15];
+    while (ino >>= 4);
+    *--q = '-';
+    do
+        *--q = "0123456789abcdef"[dev & 15];
+    while (dev >>= 4);
+    path = lrg_malloc(strlen(dir) + strlen(sub) + strlen(q) + 9);
+    if (path)
+        sprintf(path, "%s%s/%s.lrgidx", dir, sub, q);
+    return path;
+}
+
+/* whether the group table of an index of len bytes points inside its deltas
+   and inside the indexed part of the file */
+static int lrg_index_groups_ok(const unsigned char *h, size_t len,
+                               linenum_t groups, linenum_t covered) {
+    const unsigned char *g = h + LRG_INDEX_HEADER;
+    size_t deltas = LRG_INDEX_HEADER + (size_t)groups * 16;
+    linenum_t i;
+    /* the last group may point just past the deltas, if it has none */
+    for (i = 0; i < groups; ++i, g += 16)
+        if (lrg_get64(g) > covered || lrg_get64(g + 8) > len - deltas)
+            return 0;
+    return 1;
+}
+
+/* load and check the index at path for the file fd with the given stat. if
+   grown, an index of only the start of the file is taken */
+static struct lrg_index *lrg_index_open(const char *path, int fd,
+                                        const struct stat *st, int grown) {
+    struct lrg_index *x;
+    struct stat xst;
+    const unsigned char *h;
+    linenum_t hash, tail, groups, covered;
+    int xfd = open(path, O_RDONLY);
+    void *p;
+
+    if (xfd < 0)
+        return NULL;
+    if (fstat(xfd, &xst) || xst.st_size < LRG_INDEX_HEADER ||
+        (lrg_off_t)(size_t)xst.st_size != xst.st_size) {
+        close(xfd);
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)xst.st_size, PROT_READ, MAP_SHARED, xfd, 0);
+    close(xfd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    h = p;
+    groups = lrg_get64(h + 32) / LRG_INDEX_GROUP + 1;
+    covered = lrg_get64(h + 16);
+    /* if the file has not grown, it must not have been touched either */
+    if (memcmp(h, LRG_INDEX_MAGIC, 8) || !lrg_get64(h + 8) ||
+        covered > (linenum_t)st->st_size ||
+        (!grown && covered != (linenum_t)st->st_size) ||
+        lrg_get64(h + 32) != lrg_get64(h + 24) / lrg_get64(h + 8) ||
+        lrg_get64(h + 40) != (linenum_t)st->st_dev ||
+        lrg_get64(h + 48) != (linenum_t)st->st_ino ||
+        (covered == (linenum_t)st->st_size &&
+         (lrg_get64(h + 56) != (linenum_t)st->st_mtime ||
+          lrg_get64(h + 64) != LRG_MTIME_NSEC(st) ||
+          lrg_get64(h + 72) != (linenum_t)st->st_ctime ||
+          lrg_get64(h + 80) != LRG_CTIME_NSEC(st))) ||
+        groups > (linenum_t)(xst.st_size - LRG_INDEX_HEADER) / 16 ||
+        !lrg_index_groups_ok(h, (size_t)xst.st_size, groups, covered) ||
+        lrg_index_sample(fd, (lrg_off_t)covered, &hash, &tail) ||
+        hash != lrg_get64(h + 88) || tail != lrg_get64(h + 96) ||
+        !(x = lrg_malloc(sizeof(*x)))) {
+        munmap(p, (size_t)xst.st_size);
+        return NULL;
+    }
+    x->data = h, x->len = (size_t)xst.st_size;
+    x->interval = lrg_get64(h + 8), x->count = lrg_get64(h + 32);
+    x->covered = (lrg_off_t)covered, x->newlines = lrg_get64(h + 24);
+    x->groups = h + LRG_INDEX_HEADER;
+    x->deltas = x->groups + groups * 16;
+    return x;
+}
+
+static void lrg_index_close(struct lrg_index *x) {
+    munmap((void *)x->data, x->len);
+    lrg_free(x);
+}
+
+/* find a valid index for a file, either next to it (if fn is not NULL) or in
+   the cache directory. NULL if there is none. grown as for lrg_index_open */
+static struct lrg_index *lrg_index_load(const char *fn, int fd, int grown) {
+    struct lrg_index *x = NULL;
+    struct stat st;
+    char *path;
+    int cache;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return NULL;
+    for (cache = 0; !x && cache <= index_cache; ++cache) {
+        if ((path = lrg_index_path(fn, &st, cache))) {
+            x = lrg_index_open(path, fd, &st, grown);
+            lrg_free(path);
+        }
+    }
+    return x;
+}
+
+/* find the last line in the index at or before the given line. returns its
+   offset and sets *line to its line number */
+static lrg_off_t lrg_index_find(const struct lrg_index *x, linenum_t target,
+                                linenum_t *line) {
+    linenum_t j = (target - 1) / x->interval, t;
+    const unsigned char *end = x->data + x->len, *q;
+    lrg_off_t off;
+
+    if (j > x->count)
+        j = x->count;
+    t = j / LRG_INDEX_GROUP * LRG_INDEX_GROUP;
+    off = (lrg_off_t)lrg_get64(x->groups + t / LRG_INDEX_GROUP * 16);
+    q = x->deltas + lrg_get64(x->groups + t / LRG_INDEX_GROUP * 16 + 8);
+    for (; t < j && q < end; ++t) {
+        /* one LEB128 varint */
+        lrg_off_t d = 0;
+        int shift = 0;
+        while (q < end && (*q & 128) &&
+               shift + 15 < (int)sizeof(lrg_off_t) * CHAR_BIT)
+            d |= (lrg_off_t)(*q++ & 127) << shift, shift += 7;
+        if (q < end)
+            d |= (lrg_off_t)*q++ << shift;
+        /* a damaged index is not followed past the indexed part; the lines
+           from here on are scanned instead */
+        if (d < 0 || d > x->covered - off)
+            break;
+        off += d;
+    }
+    *line = 1 + t * x->interval;
+    return off;
+}
+
+#endif
+
+#if LRG_CHECKPOINTS
+/* the start of a line that has been scanned past */
+struct lrg_checkpoint {
+    linenum_t line;
+    lrg_off_t off;
+};
+#endif
+
+/* an input file that is being processed */
+struct lrg_input {
+    /* file name, used for error messages */
+    const char *fn;
+    FILEREF fd;
+    int can_seek;
+    /* size of the file, or -1 if not known (such as for pipes) */
+    lrg_off_t size;
+    /* offset of the next byte to be read */
+    lrg_off_t pos;
+    /* where reading starts, and the number of the line there. lines are
+       numbered from here, so that when the lines before it are not known,
+       the numbers need not be the same as the ones from the start */
+    lrg_off_t origin;
+    linenum_t origin_line;
+    /* the read buffer and its size, and whether the buffer is the input's
+       own instead of the one shared by every input */
+    char *buf;
+    size_t bufsize;
+    int own_buf;
+    /* the number of bytes returned by a full read. backwards scans step back
+       by this many bytes at a time */
+    size_t blocksize;
+    /* whether the whole file was read into buf when it was opened */
+    int whole;
+#if LRG_MMAP
+    /* if not NULL, the entire file mapped into memory */
+    char *map;
+#endif
+#if LRG_IO_URING
+    /* if not NULL, the file is read through this ring */
+    struct lrg_uring *ring;
+#endif
+#if LRG_THREADS
+    /* if not NULL, the file is read by this thread */
+    struct lrg_reader *reader;
+#endif
+#if LRG_INDEX
+    /* if not NULL, the line index of the file */
+    struct lrg_index *index;
+#endif
+#if LRG_CHECKPOINTS
+    /* lines seen so far in ascending order, at least mark_spacing bytes
+       apart. marks has room for mark_cap of them */
+    struct lrg_checkpoint *marks;
+    size_t n_marks, mark_cap;
+    lrg_off_t mark_spacing;
+#endif
+};
+
+#if LRG_FILLBUF_MODE == 0
+#define READ_BUFFER(in, buf, sz) lrg_fillbuf_file(buf, sz, (in)->fd)
+#elif LRG_FILLBUF_MODE == 1
+#define READ_BUFFER(in, buf, sz) lrg_fillbuf_pipe(buf, sz, (in)->fd)
+#else
+/* piece of cake for the branch predictor */
+#define READ_BUFFER(in, buf, sz)                                               \
+    ((in)->can_seek ? lrg_fillbuf_file(buf, sz, (in)->fd)                      \
+                    : lrg_fillbuf_pipe(buf, sz, (in)->fd))
+#endif
+
+#if LRG_THREADS
+/* read input on a separate thread (--threads-io) */
+static int threads_io = 0;
+/* number of threads to count newlines with (--jobs) */
+static int jobs = 1;
+
+/* a reader thread filling a ring of buffers ahead of the scanner. buffers
+   are filled and handed out in cyclic order */
+struct lrg_reader {
+    struct lrg_input *in;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* signaled whenever a buffer is filled or freed */
+    pthread_cond_t cond;
+    char *bufs[LRG_THREAD_BUFFERS];
+    /* read results and errno values for each buffer */
+    int lens[LRG_THREAD_BUFFERS], errs[LRG_THREAD_BUFFERS];
+    /* next (or current) buffer to hand out, number of filled buffers
+       including the one currently held by the scanner */
+    unsigned head, filled;
+    /* whether the scanner is holding buffer head */
+    int held;
+    /* set to ask the reader thread to stop */
+    int stop;
+    /* whether the thread has been started and not yet joined */
+    int running;
+    /* where the thread reads next, if the input is read with pread. only
+       the thread touches it while it runs */
+    lrg_off_t off;
+};
+
+static void *lrg_reader_main(void *arg) {
+    struct lrg_reader *t = arg;
+    struct lrg_input *in = t->in;
+    unsigned tail;
+    int n, old;
+
+    /* only allow cancellation while blocked on reading; stop otherwise */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (!t->stop && t->filled >= LRG_THREAD_BUFFERS)
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (t->stop)
+            break;
+        tail = (t->head + t->filled) % LRG_THREAD_BUFFERS;
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+#if USE_PREAD
+        /* from the same offset that the other ways of reading start at,
+           not from wherever the file offset happens to be */
+        if (in->can_seek) {
+            n = lrg_fillbuf_at(t->bufs[tail], in->bufsize, in->fd, t->off);
+            if (n > 0)
+                t->off += n;
+        } else
+#endif
+            n = READ_BUFFER(in, t->bufs[tail], in->bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+
+        pthread_mutex_lock(&t->lock);
+        t->lens[tail] = n, t->errs[tail] = errno;
+        ++t->filled;
+        pthread_cond_broadcast(&t->cond);
+        if (n <= 0) /* EOF or error; nothing more to read */
+            break;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* start reading from the given offset (or the current position of an input
+   that is not read with pread). 0 if OK */
+static int lrg_reader_start(struct lrg_reader *t, lrg_off_t off) {
+    t->off = off;
+    t->head = t->filled = 0;
+    t->held = t->stop = 0;
+    t->running = !pthread_create(&t->thread, NULL, &lrg_reader_main, t);
+    return !t->running;
+}
+
+static void lrg_reader_stop(struct lrg_reader *t) {
+    if (!t->running)
+        return;
+    t->running = 0;
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    /* the thread may be blocked on a read that never completes */
+    pthread_cancel(t->thread);
+    pthread_join(t->thread, NULL);
+}
+
+static void lrg_reader_close(struct lrg_reader *t) {
+    unsigned i;
+    lrg_reader_stop(t);
+    for (i = 0; i < LRG_THREAD_BUFFERS; ++i)
+        lrg_free(t->bufs[i]);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    lrg_free(t);
+}
+
+/* set up a reader thread for an input. NULL if not possible */
+static struct lrg_reader *lrg_reader_open(struct lrg_input *in) {
+    struct lrg_reader *t;
+    unsigned i;
+
+    t = lrg_malloc(sizeof(*t));
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->in = in;
+    for (i = 0; i < LRG_THREAD_BUFFERS; ++i) {
+        if (!(t->bufs[i] = lrg_malloc_aligned(in->bufsize)))
+            goto fail;
+    }
+    if (pthread_mutex_init(&t->lock, NULL))
+        goto fail;
+    if (pthread_cond_init(&t->cond, NULL)) {
+        pthread_mutex_destroy(&t->lock);
+        goto fail;
+    }
+    if (lrg_reader_start(t, in->pos)) {
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        goto fail;
+    }
+    return t;
+
+fail:
+    for (i = 0; i < LRG_THREAD_BUFFERS; ++i)
+        lrg_free(t->bufs[i]);
+    lrg_free(t);
+    return NULL;
+}
+
+/* like lrg_input_read, but takes the next buffer filled by the thread */
+static int lrg_reader_read(struct lrg_reader *t, char **data) {
+    int n;
+    pthread_mutex_lock(&t->lock);
+    if (t->held) {
+        /* the scanner is done with the previous buffer */
+        t->head = (t->head + 1) % LRG_THREAD_BUFFERS, --t->filled;
+        t->held = 0;
+        pthread_cond_broadcast(&t->cond);
+    }
+    while (!t->filled)
+        pthread_cond_wait(&t->cond, &t->lock);
+    n = t->lens[t->head];
+    if (LIKELY(n > 0))
+        *data = t->bufs[t->head], t->held = 1;
+    else /* leave the EOF or error in place for later reads */
+        errno = t->errs[t->head];
+    pthread_mutex_unlock(&t->lock);
+    return n;
+}
+
+/* seek by stopping the thread and restarting it at the new offset */
+static int lrg_reader_seek(struct lrg_reader *t, lrg_off_t off) {
+    lrg_reader_stop(t);
+#if USE_PREAD
+    if (t->in->can_seek ? off < 0 : FD_SEEK_SET(t->in->fd, off))
+        return -1;
+#else
+    if (FD_SEEK_SET(t->in->fd, off))
+        return -1;
+#endif
+    return lrg_reader_start(t, off) ? -1 : 0;
+}
+#endif
+
+/* advice given to the OS about how we are going to access the input */
+#define LRG_ADVICE_SEQUENTIAL 0
+#define LRG_ADVICE_RANDOM 1
+
+INLINE void lrg_input_advise(struct lrg_input *in, int advice) {
+    if (in->whole)
+        return;
+#if LRG_MMAP
+    if (in->map) {
+        posix_madvise(in->map, in->size,
+                      advice == LRG_ADVICE_RANDOM ? POSIX_MADV_RANDOM
+                                                  : POSIX_MADV_SEQUENTIAL);
+        return;
+    }
+#endif
+#if LRG_POSIX_FADVISE
+    if (in->can_seek)
+        posix_fadvise(in->fd, 0, 0,
+                      advice == LRG_ADVICE_RANDOM ? POSIX_FADV_RANDOM
+                                                  : POSIX_FADV_SEQUENTIAL);
+#endif
+    (void)in, (void)advice;
+}
+
+/* the read buffer is kept between files and only ever grown */
+static char *readbuf = NULL;
+static size_t readbuf_size = 0;
+
+static void lrg_free_readbuf(void) { lrg_free(readbuf); }
+
+static char *lrg_get_readbuf(size_t size) {
+    if (size > readbuf_size) {
+        if (!readbuf)
+            atexit(&lrg_free_readbuf);
+        lrg_free(readbuf);
+        readbuf = lrg_malloc_aligned(size);
+        readbuf_size = readbuf ? size : 0;
+    }
+    return readbuf;
+}
+
+/* choose the size of the read buffer for an input */
+static size_t lrg_choose_bufsize(const struct lrg_input *in, size_t blksize) {
+    size_t size = LRG_BUFSIZE;
+    if (buffer_size)
+        return buffer_size;
+#if LRG_BUFSIZE_MAX > LRG_BUFSIZE
+    if (!in->can_seek)
+        /* pipes do not give us much more than this at a time anyway */
+        return size;
+    if (in->size < 0)
+        /* block device; assume it is large */
+        size = LRG_BUFSIZE_MAX / 4;
+    else if ((size_t)in->size < size)
+        /* small file, only allocate as much as we need */
+        size = in->size ? (size_t)in->size : 1;
+    else if ((size_t)(in->size / 64) > size)
+        /* large file, use larger reads */
+        size = (size_t)(in->size / 64) < LRG_BUFSIZE_MAX
+                   ? (size_t)(in->size / 64)
+                   : LRG_BUFSIZE_MAX;
+    if (blksize > 1 && blksize <= LRG_BUFSIZE_MAX) {
+        /* whole multiple of the block size */
+        size = (size + blksize - 1) / blksize * blksize;
+        if (size > LRG_BUFSIZE_MAX)
+            size -= blksize;
+    }
+#endif
+    (void)in, (void)blksize;
+    return size;
+}
+
+#if LRG_MMAP
+/* map all of an input into memory. 1 if mapped, 0 if not */
+static int lrg_input_map(struct lrg_input *in) {
+    void *p;
+    /* the whole file must fit into the address space */
+    if (!in->can_seek || in->size <= 0 ||
+        (lrg_off_t)(size_t)in->size != in->size)
+        return 0;
+    p = mmap(NULL, (size_t)in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    in->map = p;
+    in->blocksize = buffer_size ? buffer_size : LRG_MMAP_BLOCK;
+    return 1;
+}
+#endif
+
+/* set up a reading method other than the plain buffer, if one is
+   available and makes sense for this input. 1 if set up, 0 if not */
+static int lrg_input_engine(struct lrg_input *in) {
+#if LRG_THREADS
+    if (threads_io && (in->reader = lrg_reader_open(in)))
+        return 1;
+#endif
+#if LRG_IO_URING
+    if (in->can_seek && in->size != 0 &&
+        (in->ring = lrg_uring_open(in->fd, in->bufsize)))
+        return 1;
+#endif
+#if LRG_MMAP
+    if (map_input && lrg_input_map(in))
+        return 1;
+#endif
+    (void)in;
+    return 0;
+}
+
+/* read all of a small file into the buffer, which is then handed out
+   like a mapped file, so that it takes one system call in all */
+static void lrg_input_slurp(struct lrg_input *in) {
+    int n = 0;
+    if (in->size) {
+#if USE_PREAD
+        n = lrg_fillbuf_at(in->buf, (size_t)in->size, in->fd, 0);
+#else
+        n = READ_BUFFER(in, in->buf, (size_t)in->size);
+#endif
+        /* if that failed, reading it again as usual reports the error */
+        if (n < 0)
+            return;
+    }
+    in->whole = 1, in->size = n, in->blocksize = n ? n : 1;
+}
+
+/* prepare an input for reading. an input read on another thread than the
+   main one must have a buffer of its own. 0 if OK */
+static int lrg_input_open(struct lrg_input *in, const char *fn, FILEREF fd,
+                          int own_buf) {
+    size_t blksize;
+    int small;
+    in->fn = fn;
+    in->fd = fd;
+    in->can_seek = lrg_is_seekable(fd, &in->size, &blksize);
+    in->pos = in->origin = 0;
+    in->origin_line = 1;
+    in->buf = NULL;
+    in->bufsize = in->blocksize = lrg_choose_bufsize(in, blksize);
+    in->own_buf = own_buf;
+    in->whole = 0;
+#if LRG_MMAP
+    in->map = NULL;
+#endif
+#if LRG_IO_URING
+    in->ring = NULL;
+#endif
+#if LRG_THREADS
+    in->reader = NULL;
+#endif
+#if LRG_INDEX
+    in->index = NULL;
+#endif
+#if LRG_CHECKPOINTS
+    in->marks = NULL;
+    in->n_marks = in->mark_cap = 0;
+    in->mark_spacing = LRG_CHECKPOINT_SPACING;
+#endif
+    small = LRG_SMALL_FILES && in->can_seek && in->size >= 0 &&
+            in->size <= (lrg_off_t)in->bufsize;
+    if ((small || !lrg_input_engine(in)) &&
+        !(in->buf = own_buf ? lrg_malloc_aligned(in->bufsize)
+                            : lrg_get_readbuf(in->bufsize))) {
+        lrg_alloc_fail();
+        return 1;
+    }
+    if (small)
+        lrg_input_slurp(in);
+    lrg_input_advise(in, LRG_ADVICE_SEQUENTIAL);
+    return 0;
+}
+
+static void lrg_input_close(struct lrg_input *in) {
+    lrg_out_release();
+#if LRG_THREADS
+    if (in->reader)
+        lrg_reader_close(in->reader);
+#endif
+#if LRG_IO_URING
+    if (in->ring)
+        lrg_uring_close(in->ring);
+#endif
+#if LRG_MMAP
+    if (in->map)
+        munmap(in->map, (size_t)in->size);
+#endif
+#if LRG_INDEX
+    if (in->index)
+        lrg_index_close(in->index);
+#endif
+#if LRG_CHECKPOINTS
+    lrg_free(in->marks);
+#endif
+    if (in->own_buf)
+        lrg_free(in->buf);
+}
+
+#if LRG_INDEX
+/* load the line index of an input, if it has one. fn is NULL for stdin */
+static void lrg_input_index(struct lrg_input *in, const char *fn) {
+    in->index = lrg_index_load(fn, in->fd, 0);
+#if LRG_MMAP
+    /* the file matches its index, so it is not being changed. map it if it
+       is read into the plain buffer, which stays unused then */
+    if (in->index && in->buf && !in->map)
+        lrg_input_map(in);
+#endif
+}
+#endif
+
+/* reads the next block from the input and points *data to it.
+   returns the number of bytes in the block, 0 for EOF and -1 for error.
+   *data is not changed on EOF or error. */
+INLINE int lrg_input_read(struct lrg_input *in, char **data) {
+    int n;
+    if (in->whole) {
+        /* everything from the current position is already here */
+        if ((n = (int)(in->size - in->pos)) > 0)
+            *data = in->buf + in->pos, in->pos = in->size;
+        return n;
+    }
+#if LRG_MMAP
+    if (in->map) {
+        /* the mapping is fixed, as files are only mapped if they do not
+           change (see LRG_MMAP) */
+        n = in->size - in->pos < (lrg_off_t)in->blocksize
+                ? (int)(in->size - in->pos)
+                : (int)in->blocksize;
+        *data = in->map + in->pos;
+        in->pos += n;
+        return n;
+    }
+#endif
+    /* anything written from the last block must be out before it is gone */
+    lrg_out_release();
+#if LRG_THREADS
+    if (in->reader) {
+        n = lrg_reader_read(in->reader, data);
+        if (LIKELY(n > 0))
+            in->pos += n;
+        return n;
+    }
+#endif
+#if LRG_IO_URING
+    if (in->ring)
+        return lrg_uring_read(in->ring, data, &in->pos, in->size);
+#endif
+#if USE_PREAD
+    if (in->can_seek)
+        n = lrg_fillbuf_at(in->buf, in->bufsize, in->fd, in->pos);
+    else
+#endif
+        n = READ_BUFFER(in, in->buf, in->bufsize);
+    if (LIKELY(n > 0))
+        *data = in->buf, in->pos += n;
+    return n;
+}
+
+/* seek to an absolute offset within a seekable input. 0 if OK */
+static int lrg_input_seek(struct lrg_input *in, lrg_off_t off) {
+    if (in->whole) {
+        if (off < 0 || off > in->size)
+            return -1;
+        in->pos = off;
+        return 0;
+    }
+#if LRG_MMAP
+    if (in->map) {
+        if (off < 0 || off > in->size)
+            return -1;
+        in->pos = off;
+        return 0;
+    }
+#endif
+    lrg_out_release();
+#if LRG_THREADS
+    if (in->reader) {
+        if (lrg_reader_seek(in->reader, off))
+            return -1;
+        in->pos = off;
+        return 0;
+    }
+#endif
+#if LRG_IO_URING
+    if (in->ring) {
+        if (lrg_uring_seek(in->ring, off))
+            return -1;
+        in->pos = off;
+        return 0;
+    }
+#endif
+#if USE_PREAD
+    if (in->can_seek) {
+        if (off < 0)
+            return -1;
+        in->pos = off;
+        return 0;
+    }
+#endif
+    if (FD_SEEK_SET(in->fd, off))
+        return -1;
+    in->pos = off;
+    return 0;
+}
+
+#if LRG_CHECKPOINTS
+/* remember the first line that starts in the block just read, the first byte
+   of which is on line linenum, if it is far enough from the last one */
+static void lrg_input_mark(struct lrg_input *in, const char *data, int n,
+                           linenum_t linenum) {
+    lrg_off_t off = in->pos - n;
+    const char *nl;
+    if (off < (in->n_marks ? in->marks[in->n_marks - 1].off : 0) +
+                  in->mark_spacing ||
+        !(nl = memchr(data, '\n', n)))
+        return;
+    if (in->n_marks == LRG_CHECKPOINTS_MAX) {
+        /* keep every other one */
+        size_t i;
+        for (i = 0; i < LRG_CHECKPOINTS_MAX / 2; ++i)
+            in->marks[i] = in->marks[2 * i + 1];
+        in->n_marks = i, in->mark_spacing *= 2;
+    }
+    if (in->n_marks == in->mark_cap) {
+        size_t cap = in->mark_cap ? in->mark_cap * 2 : 64;
+        struct lrg_checkpoint *p =
+            lrg_realloc(in->marks, cap * sizeof(struct lrg_checkpoint));
+        if (!p)
+            return; /* not a problem, we just scan more later */
+        in->marks = p, in->mark_cap = cap;
+    }
+    in->marks[in->n_marks].line = linenum + 1;
+    in->marks[in->n_marks++].off = off + (nl + 1 - data);
+}
+
+/* the last remembered line at or before the given line, or NULL */
+static const struct lrg_checkpoint *lrg_input_find_mark(struct lrg_input *in,
+                                                        linenum_t line) {
+    size_t lo = 0, hi = in->n_marks, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (in->marks[mid].line <= line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &in->marks[lo - 1] : NULL;
+}
+#endif
+
+#if LRG_THREADS
+/* newlines counted in chunks by several threads (--jobs). threads take the
+   chunks in order, so that the counts can be summed up as they complete */
+struct lrg_counter {
+    struct lrg_input *in;
+    pthread_mutex_t lock;
+    /* signaled whenever a chunk has been counted */
+    pthread_cond_t cond;
+    /* offset of the first chunk, number of chunks, next chunk to count */
+    lrg_off_t start;
+    size_t chunks, next;
+    /* newlines in each chunk, LRG_COUNT_PENDING if not yet counted */
+    size_t *counts;
+    /* set to ask the threads to stop */
+    int stop;
+};
+
+#define LRG_COUNT_PENDING ((size_t)-1)
+#define LRG_COUNT_ERROR ((size_t)-2)
+
+/* count the newlines between off and off + len, or LRG_COUNT_ERROR */
+static size_t lrg_count_chunk(struct lrg_input *in, char *buf, lrg_off_t off,
+                              size_t len) {
+    size_t n = 0;
+#if LRG_MMAP
+    if (in->map)
+        return memcnt(in->map + off, '\n', len);
+#endif
+    if (!buf)
+        return LRG_COUNT_ERROR;
+    while (n < len) {
+        ssize_t r = pread(in->fd, buf + n, len - n, off + n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return LRG_COUNT_ERROR;
+        n += r;
+    }
+    return memcnt(buf, '\n', len);
+}
+
+static void *lrg_counter_main(void *arg) {
+    struct lrg_counter *c = arg;
+    struct lrg_input *in = c->in;
+    char *buf = NULL;
+    size_t i, n;
+    lrg_off_t off;
+
+#if LRG_MMAP
+    if (!in->map)
+#endif
+        buf = lrg_malloc_aligned(LRG_JOBS_CHUNK);
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop && c->next < c->chunks) {
+        i = c->next++;
+        pthread_mutex_unlock(&c->lock);
+
+        off = c->start + (lrg_off_t)i * LRG_JOBS_CHUNK;
+        n = in->size - off < LRG_JOBS_CHUNK ? (size_t)(in->size - off)
+                                            : LRG_JOBS_CHUNK;
+        n = lrg_count_chunk(in, buf, off, n);
+
+        pthread_mutex_lock(&c->lock);
+        c->counts[i] = n;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    lrg_free(buf);
+    return NULL;
+}
+
+/* count the newlines after the current position with several threads until
+   at least n have been found. returns the offset of the chunk with the n-th
+   newline (or of the end of the file) and sets *lines to the number of
+   newlines before it. if anything fails, returns the current position, after
+   which the caller can just go on as usual */
+static lrg_off_t lrg_count_parallel(struct lrg_input *in, linenum_t n,
+                                    linenum_t *lines) {
+    struct lrg_counter c;
+    pthread_t *threads;
+    int i, started = 0;
+    size_t chunk = 0;
+
+    *lines = 0;
+    c.in = in, c.start = in->pos, c.next = 0, c.stop = 0;
+    c.chunks = (in->size - in->pos + LRG_JOBS_CHUNK - 1) / LRG_JOBS_CHUNK;
+    c.counts = lrg_malloc(c.chunks * sizeof(*c.counts));
+    threads = lrg_malloc(jobs * sizeof(*threads));
+    if (!c.counts || !threads)
+        goto fail_alloc;
+    if (pthread_mutex_init(&c.lock, NULL))
+        goto fail_alloc;
+    if (pthread_cond_init(&c.cond, NULL))
+        goto fail_cond;
+    for (chunk = 0; chunk < c.chunks; ++chunk)
+        c.counts[chunk] = LRG_COUNT_PENDING;
+
+    for (i = 0; i < jobs; ++i)
+        if (!pthread_create(&threads[started], NULL, &lrg_counter_main, &c))
+            ++started;
+
+    pthread_mutex_lock(&c.lock);
+    for (chunk = 0; started && chunk < c.chunks; ++chunk) {
+        while (c.counts[chunk] == LRG_COUNT_PENDING)
+            pthread_cond_wait(&c.cond, &c.lock);
+        /* on errors, let the normal reading code find and report them */
+        if (c.counts[chunk] == LRG_COUNT_ERROR || *lines + c.counts[chunk] >= n)
+            break;
+        *lines += c.counts[chunk];
+    }
+    c.stop = 1;
+    pthread_mutex_unlock(&c.lock);
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&c.cond);
+fail_cond:
+    pthread_mutex_destroy(&c.lock);
+fail_alloc:
+    lrg_free(threads);
+    lrg_free(c.counts);
+    return chunk == c.chunks ? in->size
+                             : c.start + (lrg_off_t)chunk * LRG_JOBS_CHUNK;
+}
+#endif
+
+#if LRG_INDEX
+/* a growing buffer for writing an index */
+struct lrg_index_out {
+    unsigned char *data;
+    size_t len, cap;
+};
+
+static int lrg_index_reserve(struct lrg_index_out *o, size_t n) {
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        unsigned char *p;
+        while (cap < o->len + n)
+            cap *= 2;
+        if (!(p = lrg_realloc(o->data, cap)))
+            return -1;
+        o->data = p, o->cap = cap;
+    }
+    return 0;
+}
+
+/* write the index next to the file, or to the cache directory if that does
+   not work. 0 if OK */
+static int lrg_index_write(const char *fn, const struct stat *st,
+                           const struct lrg_index_out *o) {
+    char *path, *tmp;
+    int cache, fd, ok = 0;
+    size_t done;
+    ssize_t r;
+
+    errno = ENOENT;
+    for (cache = 0; !ok && cache < 2; ++cache) {
+        if (!(path = lrg_index_path(fn, st, cache)))
+            continue;
+        if (cache) {
+            /* create the cache directory (and its parent) if needed */
+            char *slash = strrchr(path, '/'), *parent;
+            *slash = 0;
+            if ((parent = strrchr(path, '/')) && parent != path) {
+                *parent = 0;
+                mkdir(path, 0777);
+                *parent = '/';
+            }
+            mkdir(path, 0777);
+            *slash = '/';
+        }
+        /* write to a temporary file that replaces the old index at once */
+        if ((tmp = lrg_malloc(strlen(path) + sizeof(".tmp")))) {
+            sprintf(tmp, "%s.tmp", path);
+            if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0) {
+                for (done = 0; done < o->len; done += r) {
+                    r = write(fd, o->data + done, o->len - done);
+                    if (r < 0 && errno == EINTR)
+                        r = 0;
+                    else if (r <= 0)
+                        break;
+                }
+                ok = !close(fd) && done == o->len && !rename(tmp, path);
+                if (!ok)
+                    unlink(tmp);
+            }
+            lrg_free(tmp);
+        }
+        lrg_free(path);
+    }
+    if (!ok)
+        lrg_perror(fn, OPER_WRITE " the index of");
+    return !ok;
+}
+
+/* build the index of a file (--build-index). 0 if OK */
+static int lrg_index_build(const char *fn) {
+    struct lrg_input in;
+    struct lrg_index_out o = {NULL, 0, 0}, d = {NULL, 0, 0};
+    struct lrg_index *old;
+    struct stat st;
+    linenum_t newlines = 0, count = 0, hash, tail, line;
+    lrg_off_t prev = 0, start = 0;
+    size_t need = LRG_INDEX_INTERVAL, k;
+    char *data, *p, *end;
+    int fd, n = 0, ret = 1;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        lrg_perror(fn, OPER_OPEN);
+        return 1;
+    }
+    errno = 0;
+    if (!fstat(fd, &st) && !S_ISREG(st.st_mode))
+        errno = EINVAL;
+    if (errno == EINVAL || lrg_input_open(&in, fn, fd, 0)) {
+        lrg_perror(fn, OPER_READ);
+        close(fd);
+        return 1;
+    }
+
+    /* the group table goes to o and the deltas to d */
+    if ((old = lrg_index_load(fn, fd, 1)) &&
+        old->interval == LRG_INDEX_INTERVAL &&
+        (prev = lrg_index_find(old, 1 + old->count * LRG_INDEX_INTERVAL,
+                               &line),
+         line == 1 + old->count * LRG_INDEX_INTERVAL)) {
+        /* the file has only been appended to (if at all) since its last
+           index, so carry on from where that one ends */
+        size_t head = old->deltas - old->data, rest = old->len - head;
+        if (lrg_index_reserve(&o, head) || lrg_index_reserve(&d, rest)) {
+            lrg_index_close(old);
+            goto fail_alloc;
+        }
+        memcpy(o.data, old->data, o.len = head);
+        memcpy(d.data, old->deltas, d.len = rest);
+        newlines = old->newlines, count = old->count;
+        need = LRG_INDEX_INTERVAL - (size_t)(newlines % LRG_INDEX_INTERVAL);
+        start = old->covered;
+    } else {
+        prev = 0;
+        if (lrg_index_reserve(&o, LRG_INDEX_HEADER + 16))
+            goto fail_alloc;
+        o.len = LRG_INDEX_HEADER + 16;
+        memset(o.data + LRG_INDEX_HEADER, 0, 16);
+    }
+    if (old)
+        lrg_index_close(old);
+    if (start && lrg_input_seek(&in, start)) {
+        lrg_perror(fn, OPER_READ);
+        goto fail;
+    }
+    while (in.pos < st.st_size && (n = lrg_input_read(&in, &data)) > 0) {
+        /* anything appended from now on is left for the next time */
+        if (in.pos > st.st_size)
+            n -= (int)(in.pos - st.st_size), in.pos = st.st_size;
+        for (p = data, end = data + n; p < end;) {
+            k = need;
+            if (!(p = memnchr(p, '\n', &k, end - p))) {
+                newlines += need - k, need = k;
+                break;
+            }
+            newlines += need, need = LRG_INDEX_INTERVAL, ++p;
+            {
+                /* another offset, at p */
+                lrg_off_t off = in.pos - (end - p), delta = off - prev;
+                if (lrg_index_reserve(&d, 10))
+                    goto fail_alloc;
+                do {
+                    d.data[d.len++] = (unsigned char)((delta & 127) |
+                                                      (delta > 127 ? 128 : 0));
+                    delta >>= 7;
+                } while (delta);
+                prev = off;
+                if (!(++count % LRG_INDEX_GROUP)) {
+                    if (lrg_index_reserve(&o, 16))
+                        goto fail_alloc;
+                    lrg_put64(o.data + o.len, (linenum_t)off);
+                    lrg_put64(o.data + o.len + 8, (linenum_t)d.len);
+                    o.len += 16;
+                }
+            }
+        }
+    }
+    if (n < 0) {
+        lrg_perror(fn, OPER_READ);
+        goto fail;
+    }
+    if (lrg_index_sample(fd, st.st_size, &hash, &tail)) {
+        lrg_perror(fn, OPER_READ);
+        goto fail;
+    }
+
+    memcpy(o.data, LRG_INDEX_MAGIC, 8);
+    lrg_put64(o.data + 8, LRG_INDEX_INTERVAL);
+    lrg_put64(o.data + 16, (linenum_t)st.st_size);
+    lrg_put64(o.data + 24, newlines);
+    lrg_put64(o.data + 32, count);
+    lrg_put64(o.data + 40, (linenum_t)st.st_dev);
+    lrg_put64(o.data + 48, (linenum_t)st.st_ino);
+    lrg_put64(o.data + 56, (linenum_t)st.st_mtime);
+    lrg_put64(o.data + 64, LRG_MTIME_NSEC(&st));
+    lrg_put64(o.data + 72, (linenum_t)st.st_ctime);
+    lrg_put64(o.data + 80, LRG_CTIME_NSEC(&st));
+    lrg_put64(o.data + 88, hash);
+    lrg_put64(o.data + 96, tail);
+    if (lrg_index_reserve(&o, d.len))
+        goto fail_alloc;
+    if (d.len)
+        memcpy(o.data + o.len, d.data, d.len);
+    o.len += d.len;
+    ret = lrg_index_write(fn, &st, &o);
+    goto fail;
+
+fail_alloc:
+    lrg_alloc_fail();
+fail:
+    lrg_free(o.data);
+    lrg_free(d.data);
+    lrg_input_close(&in);
+    close(fd);
+    return ret;
+}
+#endif
+
+/* ========================================================= */
+/*               code scanning files for lines               */
+/* ========================================================= */
+
+/* moves *p past the n-th newline before end (n >= 1), or to end if there
+   are fewer than n. returns the number of newlines passed */
+INLINE linenum_t lrg_skip_lines(char **p, char *end, linenum_t n) {
+    size_t left = end - *p, k = n > left ? left + 1 : (size_t)n, k0 = k;
+    char *nl = (char *)memnchr(*p, '\n', &k, left);
+    if (nl) {
+        *p = nl + 1;
+        return n;
+    }
+    *p = end;
+    return k0 - k;
+}
+
+#if LRG_RECORDS
+/* the length of the lines of a file of the given size that starts with the
+   n bytes at p, if they all seem to have the same length. 0 if not */
+static lrg_off_t lrg_guess_width(const char *p, size_t n, lrg_off_t size) {
+    const char *nl = (const char *)memchr(p, '\n', n);
+    size_t w, i;
+    if (!nl || size % (lrg_off_t)(w = nl - p + 1) || n < 2 * w)
+        return 0;
+    /* every line in the block must end where it should, and nowhere else */
+    n -= n % w;
+    for (i = w - 1; i < n; i += w)
+        if (p[i] != '\n')
+            return 0;
+    return memcnt(p, '\n', n) == n / w ? (lrg_off_t)w : 0;
+}
+#endif
+
+#if LRG_BACKWARD_SCAN
+/* the number of bytes a backward scan passes on its way from the current
+   position to the byte that many (back) bytes before it. the first of those
+   (have) are still in the buffer, and beyond them it reads whole blocks. the
+   scan goes backward only if this is fewer than the bytes that scanning
+   forward from the closest known line would pass */
+INLINE lrg_off_t lrg_backward_cost(const struct lrg_input *in, lrg_off_t back,
+                                   lrg_off_t have) {
+    lrg_off_t block = (lrg_off_t)in->blocksize;
+    return back <= have ? back : have + (back - have + block - 1) / block * block;
+}
+#endif
+
+#define JUMP_LINE(ln)                                                          \
+    do {                                                                       \
+        lrg_initbuffers();                                                     \
+        buf_start = buf_next = buf_end;                                        \
+        linenum = ln;                                                          \
+    } while (0);
+
+/* linenum after a range was copied to EOF without counting its lines */
+#define LINENUM_UNKNOWN LINENUM_MAX
+
+/* the first of the intervals that ends at or after line, or n_intervals if
+   there is none. the search halves the intervals without branching on the
+   comparisons */
+static size_t lrg_interval_find(linenum_t line) {
+    const struct lrg_interval *base = intervals;
+    size_t n = n_intervals, half;
+    if (!n)
+        return 0;
+    while (n > 1) {
+        half = n / 2;
+        base = base[half].last < line ? base + half : base;
+        n -= half;
+    }
+    return (size_t)(base - intervals) + (base->last < line);
+}
+
+INLINE int lrg_processfile(struct lrg_input *in) {
+    int read_n, had_eol, show_this_linenum = show_linenums;
+    char *buf_start = NULL, *buf_prev, *buf_next, *buf_end = NULL;
+    const char *fn = in->fn;
+    struct lrg_linerange range;
+    linenum_t linenum, eof_at = LINENUM_MAX;
+    size_t range_i, n_ranges;
+    /* whether the last range ran into the end of the file. if the file does
+       not end in a newline, we are then past the start of linenum */
+    int at_eof = 0;
+    /* whether ranges can be written out without looking at every line */
+    int whole_lines = !show_linenums
+#if LRG_SUPPORT_LPS
+                      && !lps_enable
+#endif
+        ;
+#if LRG_ZERO_COPY
+    /* whether ranges may be copied by the kernel, and whether we are at the
+       first line of the current range */
+    int zero_copy = whole_lines && zero_copy_out && in->can_seek &&
+                    in->size >= 0 && !lrg_on_worker();
+    int range_start;
+    linenum_t zc_line;
+    lrg_off_t zc_start, zc_end, zc_copied;
+#endif
+#if LRG_CHECKPOINTS
+    const struct lrg_checkpoint *mark;
+#endif
+#if LRG_RECORDS
+    /* the length of every line, 0 if they are not all the same */
+    lrg_off_t width = 0;
+#endif
+
+    JUMP_LINE(in->origin_line);
+    read_n = 0;
+
+#if LRG_RECORDS
+    if (record_size && in->can_seek && in->size >= 0) {
+        if (record_size != LRG_RECORD_AUTO)
+            width = (lrg_off_t)record_size;
+        else if ((read_n = lrg_input_read(in, &buf_start)) > 0) {
+            /* guess from the first block, which we then carry on with */
+            buf_next = buf_start, buf_end = buf_start + read_n;
+            width = lrg_guess_width(buf_start, read_n, in->size - in->origin);
+        } else if (read_n < 0) {
+            lrg_perror(fn, OPER_READ);
+            return 1;
+        }
+    }
+#endif
+
+    /* intervals are taken up from the first one not before the starting line */
+    n_ranges = intervals ? n_intervals : n_linesbuf;
+    range.text = ranges_fn, range.from_end = 0, range.step = 1;
+    range_i = intervals ? lrg_interval_find(linenum) : 0;
+    for (; range_i < n_ranges; ++range_i) {
+        if (intervals)
+            range.first = intervals[range_i].first,
+            range.last = intervals[range_i].last;
+        else
+            range = linesbuf[range_i];
+
+        if (UNLIKELY(range.first > range.last))
+            continue;
+
+        if (UNLIKELY(range.first > eof_at)) {
+            /* we already know this won't work */
+            if (warn_noline)
+                lrg_eof_before(fn, range.first, eof_at);
+            if (error_on_eof)
+                return 0;
+            continue;
+        }
+
+#if LRG_RECORDS
+        if (width && range.first != linenum) {
+            /* every line is width bytes long, so we know where it starts.
+               check that the line before it ends right before it */
+            linenum_t line = range.first - in->origin_line;
+            lrg_off_t buf_off = in->pos - (buf_end - buf_start), off;
+            if (line > (linenum_t)((in->size - in->origin) / width))
+                line = (linenum_t)((in->size - in->origin) / width);
+            off = in->origin + (lrg_off_t)line * width;
+            line += in->origin_line;
+            if (off > buf_off && off <= in->pos) {
+                /* it is in the buffer (which we may have hit EOF after) */
+                if (buf_start[off - 1 - buf_off] == '\n')
+                    buf_next = buf_start + (off - buf_off), linenum = line,
+                    read_n = (int)(buf_end - buf_start);
+                else
+                    width = 0;
+            } else {
+                read_n = lrg_input_seek(in, off ? off - 1 : 0)
+                             ? -1
+                             : lrg_input_read(in, &buf_start);
+                if (read_n < 0)
+                    goto read_error;
+                buf_next = buf_start, buf_end = buf_start + read_n;
+                if (!off)
+                    linenum = 1;
+                else if (read_n && *buf_start == '\n')
+                    ++buf_next, linenum = line;
+                else {
+                    /* they were not after all, so start over and scan */
+                    width = 0;
+                    if (lrg_input_seek(in, in->origin)) {
+                        lrg_perror(fn, OPER_SEEK);
+                        return 1;
+                    }
+                    JUMP_LINE(in->origin_line);
+                }
+            }
+        }
+#endif
+
+#if LRG_INDEX
+        if (in->index) {
+            /* jump to the closest indexed line if it is ahead of us */
+            linenum_t line;
+            lrg_off_t off = lrg_index_find(in->index, range.first, &line);
+            if (line > linenum && !lrg_input_seek(in, off))
+                JUMP_LINE(line);
+        }
+#endif
+
+        /* do we need to go back? */
+        if (UNLIKELY(range.first < linenum ||
+                     (at_eof && range.first == linenum))) {
+            /* estimated bytes per line, and the number of bytes expected to
+               be passed on the way to the line going forward from off, which
+               is the offset of line */
+            lrg_off_t bpl, cost, off = in->origin;
+            linenum_t line = in->origin_line;
+
+            if (!in->can_seek) {
+                /* this is not a seekable file! cannot rewind */
+                lrg_no_rewind(fn, range.text);
+                return 1;
+            }
+
+            /* take whichever way passes the fewest bytes, guessing how many
+               by the average line length so far */
+            bpl = linenum > line ? (in->pos - (buf_end - buf_next) - off) /
+                                       (lrg_off_t)(linenum - line)
+                                 : 1;
+            if (bpl < 1)
+                bpl = 1;
+            cost = (lrg_off_t)(range.first - line) * bpl;
+#if LRG_INDEX
+            if (in->index) {
+                linenum_t iline;
+                lrg_off_t ioff = lrg_index_find(in->index, range.first, &iline);
+                if ((lrg_off_t)(range.first - iline) * bpl < cost)
+                    off = ioff, line = iline,
+                    cost = (lrg_off_t)(range.first - iline) * bpl;
+            }
+#endif
+#if LRG_CHECKPOINTS
+            mark = lrg_input_find_mark(in, range.first);
+            if (mark && (lrg_off_t)(range.first - mark->line) * bpl < cost)
+                off = mark->off, line = mark->line,
+                cost = (lrg_off_t)(range.first - mark->line) * bpl;
+#endif
+            (void)cost;
+
+#if LRG_BACKWARD_SCAN
+            if (range.first > LRG_BACKWARD_SCAN_THRESHOLD &&
+                linenum != LINENUM_UNKNOWN &&
+                lrg_backward_cost(in, (lrg_off_t)(linenum - range.first) * bpl,
+                                  buf_next - buf_start) < cost) {
+                /* offset of the start of the current buffer, the number of
+                   newlines still to pass going backwards (the one ending the
+                   line before the line is the last) and the number of bytes
+                   to look for them in */
+                lrg_off_t buf_off = in->pos - (buf_end - buf_start);
+                linenum_t left = linenum - range.first + 1;
+                size_t len = buf_next - buf_start, k, k0;
+                char *nl;
+                lrg_input_advise(in, LRG_ADVICE_RANDOM);
+                for (;;) {
+                    k = k0 = left > len ? len + 1 : (size_t)left;
+                    if ((nl = (char *)memrnchr(buf_start, '\n', &k, len))) {
+                        buf_next = nl + 1;
+                        break;
+                    }
+                    left -= k0 - k;
+                    if (!buf_off) {
+                        /* line 1 */
+                        buf_next = buf_start;
+                        break;
+                    }
+                    /* step back a block, or what remains before it */
+                    len = buf_off < (lrg_off_t)in->blocksize
+                              ? (size_t)buf_off
+                              : in->blocksize;
+                    if (lrg_input_seek(in, buf_off -= len))
+                        goto jump_backwards;
+                    read_n = lrg_input_read(in, &buf_start);
+                    if (read_n < 0)
+                        goto read_error;
+                    if (read_n < (int)len) /* the file shrank? */
+                        goto jump_backwards;
+                    buf_end = buf_start + read_n;
+                }
+                /* no jump. the buffer is already full of what we need, even
+                   if we had hit EOF before */
+                linenum = range.first, read_n = (int)(buf_end - buf_start);
+            } else
+            jump_backwards: /* goto abuse. this is somehow allowed! */
+#endif
+            {
+                if (lrg_input_seek(in, off)) {
+                    lrg_perror(fn, OPER_SEEK);
+                    lrg_no_rewind(fn, range.text);
+                    return 1;
+                }
+                lrg_input_advise(in, LRG_ADVICE_SEQUENTIAL);
+                JUMP_LINE(line);
+            }
+        }
+#if LRG_CHECKPOINTS
+        else if (in->n_marks && (mark = lrg_input_find_mark(in, range.first)) &&
+                 mark->off > in->pos && !lrg_input_seek(in, mark->off)) {
+            /* we have been further before, so skip what we already saw */
+            JUMP_LINE(mark->line);
+        }
+#endif
+
+#if LRG_ZERO_COPY
+        range_start = range.step == 1;
+#endif
+        for (;;) {
+            /* have to read more? */
+            if (buf_next == buf_end) {
+#if LRG_THREADS
+                if (jobs > 1 && linenum < range.first && in->can_seek &&
+                    in->size - in->pos >= (lrg_off_t)jobs * LRG_JOBS_CHUNK &&
+                    !lrg_on_worker()) {
+                    /* far from the line and from the end of the file, so
+                       split up the counting (unless the other threads are
+                       already busy with other files) */
+                    linenum_t lines;
+                    lrg_off_t off = lrg_count_parallel(
+                        in, range.first - linenum, &lines);
+                    if (off != in->pos && !lrg_input_seek(in, off))
+                        JUMP_LINE(linenum + lines);
+                }
+#endif
+                read_n = lrg_input_read(in, &buf_start);
+                if (UNLIKELY(read_n <= 0))
+                    goto read_error;
+                buf_next = buf_start, buf_end = buf_start + read_n;
+#if LRG_CHECKPOINTS
+                if (in->can_seek)
+                    lrg_input_mark(in, buf_start, read_n, linenum);
+#endif
+            }
+
+            if (linenum < range.first) {
+                /* skip to the first line in one go. if it is not in this
+                   buffer, this just counts the newlines in it */
+                linenum +=
+                    lrg_skip_lines(&buf_next, buf_end, range.first - linenum);
+                continue;
+            }
+
+#if LRG_ZERO_COPY
+            if (zero_copy && range_start) {
+                range_start = 0;
+                zc_start = in->pos - (buf_end - buf_next), zc_end = -1;
+                if (range.last == LINENUM_MAX) {
+                    /* everything up to EOF, but is there more to read? */
+                    if (in->pos >= in->size)
+                        goto zero_copy_skip;
+                } else {
+                    /* copy up to the last line we know the offset of before
+                       the end of the range, and write the rest normally.
+                       without one past this buffer, the range would have
+                       to be read anyway to find where it ends */
+                    zc_line = 0;
+#if LRG_INDEX
+                    if (in->index)
+                        zc_end = lrg_index_find(in->index, range.last + 1,
+                                                &zc_line);
+#endif
+#if LRG_CHECKPOINTS
+                    mark = lrg_input_find_mark(in, range.last + 1);
+                    if (mark && mark->line > zc_line)
+                        zc_end = mark->off, zc_line = mark->line;
+#endif
+                    if (zc_end <= in->pos)
+                        goto zero_copy_skip;
+                }
+
+                if (lrg_out_sync()) {
+                    lrg_broken_pipe();
+                    return 1;
+                }
+                zc_copied = lrg_zero_copy(in->fd, zc_start, zc_end);
+                if (zc_end < 0 ? errno != 0 : zc_copied != zc_end - zc_start) {
+                    /* either the kernel could not do it at all, so that we
+                       go back and write it out normally (some file systems
+                       copy nothing without an error)... */
+                    int err = errno;
+                    if (!zc_copied &&
+                        (!err || lrg_zero_copy_unsupported(err)) &&
+                        !lrg_input_seek(in, zc_start)) {
+                        zero_copy = 0, zero_copy_out = LRG_ZC_NONE;
+                        JUMP_LINE(range.first);
+                        continue;
+                    }
+                    /* ...or the file got shorter while we copied it... */
+                    if (!err) {
+                        read_n = 0;
+                        goto read_error;
+                    }
+                    /* ...or writing failed */
+                    errno = err;
+                    lrg_broken_pipe();
+                    return 1;
+                }
+
+                if (lrg_input_seek(in, zc_start + zc_copied)) {
+                    lrg_perror(fn, OPER_SEEK);
+                    return 1;
+                }
+                if (zc_end >= 0) {
+                    JUMP_LINE(zc_line);
+                    if (linenum > range.last)
+                        break;
+                    continue;
+                }
+                /* at EOF, but we do not know how many lines there were, so
+                   any range after this one goes back to a line we know */
+                JUMP_LINE(LINENUM_UNKNOWN);
+                read_n = 0;
+                break;
+            }
+        zero_copy_skip:
+#endif
+
+            buf_prev = buf_next;
+            if (whole_lines) {
+                /* write up to the end of the range or the buffer at once.
+                   with a step, that is one line, and then we skip to the
+                   next one */
+                linenum_t stop = range.step > 1 ? range.first : range.last;
+                linenum += lrg_skip_lines(&buf_next, buf_end,
+                                          stop - linenum + 1);
+                if (UNLIKELY(lrg_out_input(buf_prev, buf_next - buf_prev))) {
+                    lrg_broken_pipe();
+                    return 1;
+                }
+                if (linenum > stop) {
+                    if (range.last - stop < range.step)
+                        break;
+                    range.first += range.step;
+                }
+                continue;
+            }
+
+            buf_next = memchr(buf_next, '\n', buf_end - buf_next);
+            had_eol = buf_next != NULL;
+            buf_next = had_eol ? buf_next + 1 : buf_end;
+
+            /* show one line number and then not again */
+            if (UNLIKELY(show_this_linenum && lrg_out_linenum(linenum)) ||
+                UNLIKELY(lrg_out_input(buf_prev, buf_next - buf_prev))) {
+                lrg_broken_pipe();
+                return 1;
+            }
+            show_this_linenum = 0;
+
+            if (had_eol) {
 #if LRG_SUPPORT_LPS
-                if (lps_enable)
+                if (lps_enable) {
+                    if (lrg_out_sync()) {
+                        lrg_broken_pipe();
+                        return 1;
+                    }
                     lps_sleep();
+                }
+#endif
+                show_this_linenum = show_linenums; /* maybe show again */
+                if (linenum++ == range.last)
+                    break;
+                if (range.step > 1) {
+                    if (range.last - range.first < range.step)
+                        break;
+                    range.first += range.step;
+                }
+            }
+        }
+        /* linenum is one past range.last here if all went well */
+
+    read_error:
+        if (UNLIKELY(read_n < 0)) {
+            /* file error */
+            lrg_perror(fn, OPER_READ);
+            return 1;
+        }
+        at_eof = read_n == 0;
+        if (UNLIKELY(read_n == 0 && range.last != LINENUM_MAX)) {
+            /* reached the end of the file before first or last line */
+            eof_at = linenum;
+            if (warn_noline)
+                lrg_eof_before(
+                    fn, linenum >= range.first ? range.last : range.first,
+                    eof_at);
+            got_eof = 1;
+            if (error_on_eof)
+                return 0;
+            read_n = buf_end - buf_start;
+        }
+    }
+    return 0;
+}
+
+/* ========================================================= */
+/*           reading ranges that are not in order            */
+/* ========================================================= */
+
+/* lines that were read before it was the turn of their range are kept aside
+   in a store, which has the first LRG_REORDER_MEMORY bytes in memory and the
+   rest in a temporary file. every range has a list of spans in it */
+struct lrg_span {
+    lrg_off_t off;
+    size_t len;
+    /* the next span of the same range, or LRG_NO_SPAN */
+    size_t next;
+};
+
+#define LRG_NO_SPAN ((size_t)-1)
+
+struct lrg_piece {
+    /* the first and last of the spans kept aside */
+    size_t head, tail;
+    /* the number of the next line to write, how far apart the lines are,
+       and whether we are at the start of one. for -l */
+    linenum_t shown, step;
+    int bol;
+};
+
+struct lrg_plan {
+    struct lrg_piece *pieces;
+    /* ranges sorted by their first line, and the ranges being read */
+    size_t *order, *active;
+    struct lrg_span *spans;
+    size_t n_spans, span_cap;
+    /* the number of ranges with spans. the store is emptied at 0 */
+    size_t n_kept;
+    char *mem;
+    FILE *spill;
+    /* the number of bytes in the store */
+    lrg_off_t size;
+};
+
+static int lrg_plan_compare(const void *a, const void *b) {
+    linenum_t x = linesbuf[*(const size_t *)a].first,
+              y = linesbuf[*(const size_t *)b].first;
+    return x < y ? -1 : x > y;
+}
+
+/* writes out n bytes of the lines of a range. from_input says whether
+   they are in the input's buffer (see lrg_out_input). 0 if OK */
+static int lrg_piece_write(struct lrg_piece *pc, const char *p, size_t n,
+                           int from_input) {
+    const char *end = p + n, *nl, *next;
+    int (*out)(const char *, size_t) =
+        from_input ? &lrg_out_input : &lrg_out_write;
+    int per_line = show_linenums
+#if LRG_SUPPORT_LPS
+                   || lps_enable
+#endif
+        ;
+    if (!per_line) {
+        if (n && out(p, n))
+            goto fail;
+        return 0;
+    }
+    for (; p < end; p = next) {
+        if (pc->bol && show_linenums && lrg_out_linenum(pc->shown))
+            goto fail;
+        nl = memchr(p, '\n', end - p);
+        next = nl ? nl + 1 : end;
+        if (out(p, next - p))
+            goto fail;
+        if ((pc->bol = nl != NULL)) {
+            pc->shown += pc->step;
+#if LRG_SUPPORT_LPS
+            if (lps_enable) {
+                if (lrg_out_sync())
+                    goto fail;
+                lps_sleep();
+            }
+#endif
+        }
+    }
+    return 0;
+fail:
+    lrg_broken_pipe();
+    return 1;
+}
+
+/* keeps n bytes of the lines of a range aside. 0 if OK */
+static int lrg_plan_keep(struct lrg_plan *pl, struct lrg_piece *pc,
+                         const char *p, size_t n) {
+    struct lrg_span *span;
+    size_t part;
+    if (!n)
+        return 0;
+
+    if (pc->head != LRG_NO_SPAN &&
+        pl->spans[pc->tail].off + (lrg_off_t)pl->spans[pc->tail].len ==
+            pl->size) {
+        /* right after what this range has already */
+        pl->spans[pc->tail].len += n;
+    } else {
+        if (pl->n_spans == pl->span_cap) {
+            size_t cap = pl->span_cap ? pl->span_cap * 2 : 64;
+            span = lrg_realloc(pl->spans, sizeof(*span) * cap);
+            if (!span) {
+                lrg_alloc_fail();
+                return 1;
+            }
+            pl->spans = span, pl->span_cap = cap;
+        }
+        span = &pl->spans[pl->n_spans];
+        span->off = pl->size, span->len = n, span->next = LRG_NO_SPAN;
+        if (pc->head == LRG_NO_SPAN)
+            pc->head = pl->n_spans, ++pl->n_kept;
+        else
+            pl->spans[pc->tail].next = pl->n_spans;
+        pc->tail = pl->n_spans++;
+    }
+
+    if (pl->size < LRG_REORDER_MEMORY) {
+        if (!pl->mem && !(pl->mem = lrg_malloc(LRG_REORDER_MEMORY))) {
+            lrg_alloc_fail();
+            return 1;
+        }
+        part = LRG_REORDER_MEMORY - (size_t)pl->size;
+        if (part > n)
+            part = n;
+        memcpy(pl->mem + (size_t)pl->size, p, part);
+        pl->size += part, p += part, n -= part;
+    }
+    if (n) {
+        if (!pl->spill && !(pl->spill = tmpfile()))
+            goto fail;
+        if (FILE_SEEK_SET(pl->spill, pl->size - LRG_REORDER_MEMORY) ||
+            !fwrite(p, n, 1, pl->spill))
+            goto fail;
+        pl->size += n;
+    }
+    return 0;
+fail:
+    lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_WRITE);
+    return 1;
+}
+
+/* writes out what was kept aside for a range. 0 if OK */
+static int lrg_plan_flush(struct lrg_plan *pl, struct lrg_piece *pc) {
+    char tmp[BUFSIZ];
+    size_t i, part;
+    if (pc->head == LRG_NO_SPAN)
+        return 0;
+
+    for (i = pc->head; i != LRG_NO_SPAN; i = pl->spans[i].next) {
+        lrg_off_t off = pl->spans[i].off;
+        size_t n = pl->spans[i].len;
+        if (off < LRG_REORDER_MEMORY) {
+            part = LRG_REORDER_MEMORY - (size_t)off;
+            if (part > n)
+                part = n;
+            if (lrg_piece_write(pc, pl->mem + (size_t)off, part, 0))
+                return 1;
+            off += part, n -= part;
+        }
+        if (n && FILE_SEEK_SET(pl->spill, off - LRG_REORDER_MEMORY))
+            goto fail;
+        for (; n; n -= part) {
+            part = n < sizeof(tmp) ? n : sizeof(tmp);
+            if (!fread(tmp, part, 1, pl->spill))
+                goto fail;
+            if (lrg_piece_write(pc, tmp, part, 0))
+                return 1;
+        }
+    }
+
+    pc->head = LRG_NO_SPAN;
+    if (!--pl->n_kept) /* nothing is kept aside anymore, so start over */
+        pl->n_spans = 0, pl->size = 0;
+    return 0;
+fail:
+    lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_READ);
+    return 1;
+}
+
+/* like lrg_processfile, but reads the ranges in one pass no matter the order
+   they are in. the lines of a range are written out as they are read when it
+   is its turn, and kept aside until then otherwise */
+static int lrg_processfile_planned(struct lrg_input *in) {
+    struct lrg_plan pl;
+    struct lrg_linerange range;
+    size_t n = n_linesbuf, n_order = 0, n_active, next = 0, cur = 0, i, j;
+    char *buf_start = NULL, *buf_next = NULL, *buf_end = NULL, *p;
+    linenum_t linenum = in->origin_line, start, stop, eof_at = LINENUM_MAX;
+    int read_n = 0, result = 1;
+
+    memset(&pl, 0, sizeof(pl));
+    pl.pieces = lrg_malloc((n + 1) * sizeof(*pl.pieces));
+    pl.order = lrg_malloc((2 * n + 1) * sizeof(*pl.order));
+    if (!pl.pieces || !pl.order) {
+        lrg_alloc_fail();
+        goto done;
+    }
+    pl.active = pl.order + n;
+    for (i = 0; i < n; ++i) {
+        pl.pieces[i].head = LRG_NO_SPAN;
+        pl.pieces[i].shown = linesbuf[i].first, pl.pieces[i].bol = 1;
+        pl.pieces[i].step = linesbuf[i].step;
+        if (linesbuf[i].first <= linesbuf[i].last)
+            pl.order[n_order++] = i;
+    }
+    qsort(pl.order, n_order, sizeof(*pl.order), &lrg_plan_compare);
+
+    for (n_active = 0;;) {
+        /* write out what the ranges whose turn it is have so far, and move
+           on from those that are done */
+        for (; cur < n; ++cur) {
+            range = linesbuf[cur];
+            if (lrg_plan_flush(&pl, &pl.pieces[cur]))
+                goto done;
+            if (range.first <= range.last && linenum <= range.last)
+                break;
+        }
+        if (cur == n)
+            break;
+
+        for (i = j = 0; i < n_active; ++i)
+            if (linesbuf[pl.active[i]].last >= linenum)
+                pl.active[j++] = pl.active[i];
+        n_active = j;
+        while (next < n_order && linesbuf[pl.order[next]].first <= linenum)
+            pl.active[n_active++] = pl.order[next++];
+
+        if (buf_next == buf_end) {
+            read_n = lrg_input_read(in, &buf_start);
+            if (read_n <= 0)
+                break;
+            buf_next = buf_start, buf_end = buf_start + read_n;
+        }
+
+        if (!n_active) {
+            /* skip to the next range to start */
+            linenum += lrg_skip_lines(&buf_next, buf_end,
+                                      linesbuf[pl.order[next]].first - linenum);
+            continue;
+        }
+
+        /* the lines up to the next range to start or end, or the next line
+           of a range with a step, are read for the same ranges */
+        stop = next < n_order ? linesbuf[pl.order[next]].first - 1
+                              : LINENUM_MAX;
+        for (i = 0; i < n_active; ++i) {
+            range = linesbuf[pl.active[i]];
+            if (range.last < stop)
+                stop = range.last;
+            if (range.step > 1) {
+                linenum_t line = lrg_next_in_range(&range, linenum);
+                if (line - 1 < stop)
+                    stop = line > linenum ? line - 1 : linenum;
+            }
+        }
+        p = buf_next, start = linenum;
+        linenum += lrg_skip_lines(&buf_next, buf_end, stop - linenum + 1);
+        for (i = 0; i < n_active; ++i) {
+            struct lrg_piece *pc = &pl.pieces[pl.active[i]];
+            range = linesbuf[pl.active[i]];
+            if (range.step > 1 && lrg_next_in_range(&range, start) != start)
+                continue;
+            if (pl.active[i] == cur ? lrg_piece_write(pc, p, buf_next - p, 1)
+                                    : lrg_plan_keep(&pl, pc, p, buf_next - p))
+                goto done;
+        }
+    }
+
+    if (read_n < 0) {
+        lrg_perror(in->fn, OPER_READ);
+        goto done;
+    }
+    /* at EOF, what was not found is found in the order of the ranges */
+    for (; cur < n; ++cur) {
+        range = linesbuf[cur];
+        if (lrg_plan_flush(&pl, &pl.pieces[cur]))
+            goto done;
+        if (range.first > range.last || linenum > range.last)
+            continue;
+        if (range.first > eof_at) {
+            if (warn_noline)
+                lrg_eof_before(in->fn, range.first, eof_at);
+        } else if (range.last != LINENUM_MAX) {
+            eof_at = linenum;
+            if (warn_noline)
+                lrg_eof_before(
+                    in->fn, linenum >= range.first ? range.last : range.first,
+                    eof_at);
+        } else
+            continue;
+        got_eof = 1;
+        if (error_on_eof)
+            break;
+    }
+    result = 0;
+
+done:
+    if (pl.spill)
+        fclose(pl.spill);
+    lrg_free(pl.mem);
+    lrg_free(pl.spans);
+    lrg_free(pl.order);
+    lrg_free(pl.pieces);
+    return result;
+}
+
+static int lrg_process(struct lrg_input *in) {
+    /* read ranges that go back in one pass if they cannot be read otherwise,
+       or if it takes keeping few lines aside */
+    if (!ranges_ascending &&
+        (!in->can_seek || (reorder_lines <= LRG_REORDER_LINES
+#if LRG_INDEX
+                           && !in->index
 #endif
-                show_this_linenum = show_linenums; /* maybe show again */
-                if (linenum++ == range.last)
-                    break;
+#if LRG_RECORDS
+                           && !record_size
+#endif
+                           )))
+        return lrg_processfile_planned(in);
+    return lrg_processfile(in);
+}
+
+/* ========================================================= */
+/*             reading lines counted from the end            */
+/* ========================================================= */
+
+#if LRG_BACKWARD_SCAN
+/* finds where the given number of last lines of a seekable file start by
+   reading it backwards from the end. *lines is set to how many lines there
+   are from *off on, which is fewer than wanted only if the file has fewer
+   lines than that, in which case *off is 0. 0 if OK */
+static int lrg_find_last_lines(struct lrg_input *in, linenum_t want,
+                               lrg_off_t *off, linenum_t *lines) {
+    lrg_off_t end = in->size, start;
+    linenum_t found = 0;
+    size_t len, k, k0;
+    char *data = NULL, *nl;
+    int read_n;
+
+    *off = 0, *lines = 0;
+    if (!end)
+        return 0;
+    lrg_input_advise(in, LRG_ADVICE_RANDOM);
+    while (end > 0) {
+        start = end > (lrg_off_t)in->blocksize ? end - in->blocksize : 0;
+        if (lrg_input_seek(in, start)) {
+            lrg_perror(in->fn, OPER_SEEK);
+            return 1;
+        }
+        read_n = lrg_input_read(in, &data);
+        if (read_n < 0) {
+            lrg_perror(in->fn, OPER_READ);
+            return 1;
+        }
+        len = (size_t)(end - start);
+        if ((size_t)read_n < len) /* the file shrank? then that is its end */
+            len = read_n;
+        if (end == in->size && len && data[len - 1] == '\n')
+            --len; /* this one ends the last line and starts no other */
+        k = k0 = want - found > len ? len + 1 : (size_t)(want - found);
+        if ((nl = (char *)memrnchr(data, '\n', &k, len))) {
+            /* found them all. the last newline found ends the line before */
+            *off = start + (nl - data) + 1;
+            *lines = want;
+            return 0;
+        }
+        found += k0 - k;
+        end = start;
+    }
+    *lines = found + 1;
+    return 0;
+}
+
+/* counts the lines before off, which is where a line starts, marking lines
+   on the way. 0 if OK */
+static int lrg_count_lines_before(struct lrg_input *in, lrg_off_t off,
+                                  linenum_t *lines) {
+    char *data;
+    int read_n = 0;
+    *lines = 0;
+    if (lrg_input_seek(in, 0)) {
+        lrg_perror(in->fn, OPER_SEEK);
+        return 1;
+    }
+    lrg_input_advise(in, LRG_ADVICE_SEQUENTIAL);
+    while (in->pos < off && (read_n = lrg_input_read(in, &data)) > 0) {
+#if LRG_CHECKPOINTS
+        lrg_input_mark(in, data, read_n, *lines + 1);
+#endif
+        if (in->pos > off)
+            read_n -= (int)(in->pos - off);
+        *lines += memcnt(data, '\n', read_n);
+    }
+    if (read_n < 0) {
+        lrg_perror(in->fn, OPER_READ);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+static int lrg_resolve_lines(linenum_t lines);
+
+/* reads the whole input, keeping only as many of its last lines as needed,
+   and then writes out the ranges from them. for input that cannot be read
+   backwards, such as pipes. if there are also lines counted from the start,
+   the input is read again, or a copy of it if it cannot be */
+static int lrg_process_last_lines(struct lrg_input *in) {
+    FILE *copy = NULL;
+    char *tail = NULL, *data, *p, *q;
+    /* the bytes kept, room for them, the newlines in them, and how many
+       bytes to have before trying to drop lines again */
+    size_t len = 0, cap = 0, nl = 0, check = 0, c, k, i;
+    linenum_t lines = 0, first;
+    int read_n, partial = 0, result = 1;
+    struct lrg_piece pc;
+
+    if (ranges_mixed && !in->can_seek && !(copy = tmpfile())) {
+        lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_WRITE);
+        return 1;
+    }
+    while ((read_n = lrg_input_read(in, &data)) > 0) {
+        c = memcnt(data, '\n', read_n);
+        lines += c, partial = data[read_n - 1] != '\n';
+        if (copy && !fwrite(data, read_n, 1, copy)) {
+            lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_WRITE);
+            goto done;
+        }
+        if (ranges_mixed) /* only counting, to read it again from the start */
+            continue;
+        if (len + read_n > cap) {
+            p = lrg_realloc(tail, cap = (len + read_n) * 2);
+            if (!p) {
+                lrg_alloc_fail();
+                goto done;
             }
+            tail = p;
         }
-        /* linenum is one past range.last here if all went well */
+        memcpy(tail + len, data, read_n);
+        len += read_n, nl += c;
+        if (nl > lines_from_end && len >= check) {
+            /* drop the lines before the last ones once that is at least half
+               of what we have */
+            k = nl - (size_t)lines_from_end;
+            p = (char *)memnchr(tail, '\n', &k, len) + 1;
+            if ((size_t)(p - tail) >= len / 2) {
+                len -= p - tail, nl = (size_t)lines_from_end;
+                memmove(tail, p, len);
+            }
+            check = len * 2;
+        }
+    }
+    if (read_n < 0) {
+        lrg_perror(in->fn, OPER_READ);
+        goto done;
+    }
+
+    lines += partial;
+    if (lrg_resolve_lines(lines))
+        goto done;
+    if (copy) {
+        struct lrg_input again;
+        if (fflush(copy) || fseek(copy, 0, SEEK_SET)) {
+            lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_WRITE);
+            goto done;
+        }
+#ifdef GET_FILE_FD
+        if (!lrg_input_open(&again, in->fn, GET_FILE_FD(copy), 0)) {
+#else
+        if (!lrg_input_open(&again, in->fn, copy, 0)) {
+#endif
+            result = lrg_process(&again);
+            lrg_input_close(&again);
+        }
+        goto done;
+    } else if (ranges_mixed) {
+        if (lrg_input_seek(in, 0))
+            lrg_perror(in->fn, OPER_SEEK);
+        else
+            result = lrg_process(in);
+        goto done;
+    }
+
+    /* the number of the first line kept */
+    first = lines - (nl + partial) + 1;
+    for (i = 0; i < n_linesbuf && len; ++i) {
+        struct lrg_linerange range = linesbuf[i];
+        if (range.first > range.last)
+            continue;
+        p = tail;
+        if (range.first > first)
+            lrg_skip_lines(&p, tail + len, range.first - first);
+        pc.shown = range.first, pc.step = range.step, pc.bol = 1;
+        for (;;) {
+            /* all of it, or one line at a time with a step */
+            q = p;
+            lrg_skip_lines(&q, tail + len,
+                           range.step > 1 ? 1 : range.last - range.first + 1);
+            if (lrg_piece_write(&pc, p, q - p, 0))
+                goto done;
+            if (range.step == 1 || range.last - range.first < range.step ||
+                q == tail + len)
+                break;
+            range.first += range.step, p = q;
+            lrg_skip_lines(&p, tail + len, range.step - 1);
+        }
+    }
+    result = 0;
+done:
+    if (copy)
+        fclose(copy);
+    lrg_free(tail);
+    return result;
+}
+
+/* like lrg_process, when some ranges count lines from the end. the last lines
+   are found by reading backwards from the end if possible, in which case the
+   lines before them are only counted if their numbers are needed */
+static int lrg_process_from_end(struct lrg_input *in) {
+#if LRG_BACKWARD_SCAN
+    if (in->can_seek && in->size >= 0) {
+        lrg_off_t off;
+        linenum_t lines, before = 0;
+        size_t i;
+        int result;
+#if LRG_INDEX
+        struct lrg_index *index = in->index;
+#endif
+
+        if (lrg_find_last_lines(in, lines_from_end, &off, &lines) ||
+            (off && (show_linenums || ranges_mixed) &&
+             lrg_count_lines_before(in, off, &before)) ||
+            lrg_resolve_lines(before + lines))
+            return 1;
+
+        /* start from the last lines unless a line before them is needed.
+           if they were not counted, the lines are numbered from there */
+        in->origin = off, in->origin_line = before + 1;
+        for (i = 0; i < n_linesbuf; ++i)
+            if (linesbuf[i].first <= linesbuf[i].last &&
+                linesbuf[i].first <= before)
+                in->origin = 0, in->origin_line = 1;
+#if LRG_INDEX
+        if (in->origin && !before) /* its lines are numbered from the start */
+            in->index = NULL;
+#endif
+        if (lrg_input_seek(in, in->origin)) {
+            lrg_perror(in->fn, OPER_SEEK);
+            return 1;
+        }
+        lrg_input_advise(in, LRG_ADVICE_SEQUENTIAL);
+        result = lrg_process(in);
+#if LRG_INDEX
+        in->index = index;
+#endif
+        return result;
+    }
+#endif
+    return lrg_process_last_lines(in);
+}
+
+/* ========================================================= */
+/*                  picking lines at random                  */
+/* ========================================================= */
+
+/* a 32-bit xorshift, which is plenty for picking lines */
+static unsigned long lrg_xorshift(void) {
+    sample_state ^= (sample_state << 13) & 0xFFFFFFFFUL;
+    sample_state ^= sample_state >> 17;
+    sample_state ^= (sample_state << 5) & 0xFFFFFFFFUL;
+    return sample_state;
+}
+
+/* a random number in (0, 1) with 52 random bits */
+static double lrg_random(void) {
+    double hi = (double)(lrg_xorshift() >> 12);
+    return (hi * 4294967296.0 + (double)lrg_xorshift() + 0.5) /
+           4503599627370496.0;
+}
+
+/* a random number from 0 to n - 1 */
+static linenum_t lrg_random_below(linenum_t n) {
+    linenum_t r = (linenum_t)(lrg_random() * (double)n);
+    return r < n ? r : n - 1;
+}
+
+static void lrg_random_seed(unsigned long seed) {
+    sample_state = (seed * 2654435761UL + 0x9E3779B9UL) & 0xFFFFFFFFUL;
+    if (!sample_state)
+        sample_state = 1;
+}
+
+#define LRG_LN2 0.69314718055994530942
+
+/* the natural logarithm of x, 0 < x <= 1. we do not want to need libm */
+static double lrg_log(double x) {
+    double z, z2, sum = 0;
+    int e = 0, i;
+    while (x < 0.5)
+        x *= 2, ++e;
+    /* ln x = 2 atanh z, where z = (x - 1) / (x + 1) is within [-1/3, 0] */
+    z = (x - 1) / (x + 1), z2 = z * z;
+    for (i = 1; i < 40; i += 2, z *= z2)
+        sum += z / i;
+    return 2 * sum - e * LRG_LN2;
+}
+
+/* e to the power of x, x <= 0 */
+static double lrg_exp(double x) {
+    double t = 1, sum = 1;
+    int e = 0, i;
+    while (x < -0.5)
+        x += LRG_LN2, ++e;
+    for (i = 1; i < 20; ++i)
+        t *= x / i, sum += t;
+    while (e--)
+        sum *= 0.5;
+    return sum;
+}
+
+static int lrg_push_linerange(linenum_t first, linenum_t last,
+                              const char *text);
+static void lrg_plan_lines(void);
+
+static int lrg_linenum_compare(const void *a, const void *b) {
+    linenum_t x = *(const linenum_t *)a, y = *(const linenum_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* makes the ranges k of the lines 1 to n picked at random, in order. 0 if OK */
+static int lrg_sample_ranges(linenum_t n, linenum_t k) {
+    /* pick the lines to leave out instead if there are fewer of those */
+    int out = k > n / 2;
+    linenum_t m = out ? n - k : k, line;
+    linenum_t *picked;
+    size_t have = 0, i, j;
+
+    n_linesbuf = 0;
+    if (k >= n) {
+        if (n && lrg_push_linerange(1, n, SAMPLE_TEXT))
+            return 1;
+        lrg_plan_lines();
+        return 0;
+    }
+    if (m >= (size_t)-1 / sizeof(*picked) ||
+        !(picked = lrg_malloc(((size_t)m + 1) * sizeof(*picked)))) {
+        lrg_alloc_fail();
+        return 1;
+    }
+    /* draw until there are m different lines */
+    while (have < m) {
+        for (i = have; i < m; ++i) {
+            picked[i] = lrg_random_below(n) + 1;
+        }
+        qsort(picked, (size_t)m, sizeof(*picked), &lrg_linenum_compare);
+        for (i = j = 0; i < m; ++i)
+            if (!j || picked[i] != picked[j - 1])
+                picked[j++] = picked[i];
+        have = j;
+    }
+
+    for (i = 0, line = 1; i <= m; ++i) {
+        if (out) {
+            /* the lines between those left out */
+            linenum_t last = i < m ? picked[i] - 1 : n;
+            if (line <= last && lrg_push_linerange(line, last, SAMPLE_TEXT))
+                goto fail;
+            if (i < m)
+                line = picked[i] + 1;
+        } else if (i < m) {
+            if (n_linesbuf && linesbuf[n_linesbuf - 1].last + 1 == picked[i])
+                ++linesbuf[n_linesbuf - 1].last;
+            else if (lrg_push_linerange(picked[i], picked[i], SAMPLE_TEXT))
+                goto fail;
+        }
+    }
+    lrg_free(picked);
+    lrg_plan_lines();
+    return 0;
+fail:
+    lrg_free(picked);
+    return 1;
+}
+
+/* the number of lines in an input that has n newlines before off, reading
+   the rest of it (and the byte before off, to see whether it ends a line).
+   0 if OK */
+static int lrg_lines_after(struct lrg_input *in, lrg_off_t off, linenum_t n,
+                           linenum_t *lines) {
+    char *data;
+    int read_n, first = 1, last = '\n';
+    if (off && lrg_input_seek(in, off - 1)) {
+        lrg_perror(in->fn, OPER_SEEK);
+        return 1;
+    }
+    while ((read_n = lrg_input_read(in, &data)) > 0) {
+        n += memcnt(data, '\n', read_n);
+        if (first && off && *data == '\n')
+            --n;
+        first = 0, last = data[read_n - 1];
+    }
+    if (read_n < 0) {
+        lrg_perror(in->fn, OPER_READ);
+        return 1;
+    }
+    *lines = n + (last != '\n');
+    return 0;
+}
+
+/* the number of lines in a seekable file, if it can be found without reading
+   all of it: from an index and whatever was appended after it, or from the
+   length of the lines. 0 if found, < 0 if not, > 0 on error */
+static int lrg_known_lines(struct lrg_input *in, linenum_t *lines) {
+    lrg_off_t off = -1;
+    linenum_t n = 0;
+#if LRG_RECORDS
+    char *data = NULL;
+    int read_n;
+#endif
+
+#if LRG_RECORDS
+    if (record_size) {
+        lrg_off_t width = (lrg_off_t)record_size;
+        if (record_size == LRG_RECORD_AUTO) {
+            if ((read_n = lrg_input_read(in, &data)) < 0)
+                goto read_error;
+            width = read_n ? lrg_guess_width(data, read_n, in->size) : 0;
+            if (lrg_input_seek(in, 0))
+                goto seek_error;
+        }
+        if (width) {
+            *lines = (linenum_t)((in->size + width - 1) / width);
+            return 0;
+        }
+    }
+#endif
+#if LRG_INDEX
+    if (in->index)
+        off = in->index->covered, n = in->index->newlines;
+#endif
+    if (off < 0)
+        return -1;
+    if (lrg_lines_after(in, off, n, lines))
+        return 1;
+    if (lrg_input_seek(in, 0))
+        goto seek_error;
+    return 0;
+
+seek_error:
+    lrg_perror(in->fn, OPER_SEEK);
+    return 1;
+#if LRG_RECORDS
+read_error:
+    lrg_perror(in->fn, OPER_READ);
+    return 1;
+#endif
+}
+
+/* a line kept by lrg_process_reservoir */
+struct lrg_picked {
+    linenum_t line;
+    char *text;
+    size_t len, cap;
+};
+
+static int lrg_picked_compare(const void *a, const void *b) {
+    linenum_t x = ((const struct lrg_picked *)a)->line,
+              y = ((const struct lrg_picked *)b)->line;
+    return x < y ? -1 : x > y;
+}
+
+/* picks lines at random in one pass over the input, keeping only the lines
+   picked so far, and then writes them out in order. with Li's algorithm L,
+   the number of lines until the next one to pick is drawn at once, and those
+   are skipped like the lines before a range */
+static int lrg_process_reservoir(struct lrg_input *in) {
+    struct lrg_picked *res, *pk = NULL;
+    size_t k = (size_t)sample_lines, have = 0, i;
+    linenum_t linenum = 1, next = 1, passed;
+    char *data, *buf_next, *buf_end, *p;
+    double w = 1, skip;
+    int read_n, result = 1;
+    struct lrg_piece pc;
+
+    if (sample_lines >= (size_t)-1 / sizeof(*res) ||
+        !(res = lrg_malloc((k + 1) * sizeof(*res)))) {
+        lrg_alloc_fail();
+        return 1;
+    }
+    while ((read_n = lrg_input_read(in, &data)) > 0) {
+        for (buf_next = data, buf_end = data + read_n; buf_next < buf_end;) {
+            if (linenum < next) {
+                linenum +=
+                    lrg_skip_lines(&buf_next, buf_end, next - linenum);
+                continue;
+            }
+            if (!pk) {
+                /* keep this line, at first in addition to the others and
+                   then in place of one of them */
+                if (have < k)
+                    pk = &res[have++], pk->text = NULL, pk->cap = 0;
+                else
+                    pk = &res[lrg_random_below(k)];
+                pk->line = linenum, pk->len = 0;
+            }
+            p = buf_next;
+            passed = lrg_skip_lines(&buf_next, buf_end, 1);
+            if (pk->len + (buf_next - p) > pk->cap) {
+                size_t cap = (pk->len + (buf_next - p)) * 2;
+                char *text = lrg_realloc(pk->text, cap);
+                if (!text) {
+                    lrg_alloc_fail();
+                    goto done;
+                }
+                pk->text = text, pk->cap = cap;
+            }
+            memcpy(pk->text + pk->len, p, buf_next - p);
+            pk->len += buf_next - p;
+            if (!passed) /* the line goes on in the next block */
+                continue;
+
+            pk = NULL, next = ++linenum;
+            if (have == k) {
+                /* how many lines to pass before picking another */
+                w *= lrg_exp(lrg_log(lrg_random()) / (double)k);
+                skip = 1 - w < 1 ? lrg_log(lrg_random()) / lrg_log(1 - w)
+                                 : (double)LINENUM_MAX;
+                next = skip < (double)(LINENUM_MAX - linenum)
+                           ? linenum + (linenum_t)skip
+                           : LINENUM_MAX;
+            }
+        }
+    }
+    if (read_n < 0) {
+        lrg_perror(in->fn, OPER_READ);
+        goto done;
+    }
+
+    qsort(res, have, sizeof(*res), &lrg_picked_compare);
+    for (i = 0; i < have; ++i) {
+        pc.shown = res[i].line, pc.step = 1, pc.bol = 1;
+        if (lrg_piece_write(&pc, res[i].text, res[i].len, 0))
+            goto done;
+    }
+    result = 0;
+done:
+    for (i = 0; i < have; ++i)
+        lrg_free(res[i].text);
+    lrg_free(res);
+    return result;
+}
+
+/* like lrg_process, for --sample. if the number of lines is known, the lines
+   are picked first and then read like any ranges */
+static int lrg_process_sample(struct lrg_input *in) {
+    linenum_t lines;
+    int known = in->can_seek && in->size >= 0 ? lrg_known_lines(in, &lines)
+                                              : -1;
+    if (known < 0)
+        return lrg_process_reservoir(in);
+    if (known || lrg_sample_ranges(lines, sample_lines))
+        return 1;
+    return lrg_processfile(in);
+}
+
+/* files are opened in binary mode if anything depends on byte offsets */
+#define LRG_FOPEN_MODE                                                         \
+    (LRG_BACKWARD_SCAN || LRG_CHECKPOINTS || LRG_RECORDS ? "rb" : "r")
+
+#if LRG_OPEN_AHEAD
+/* the file after the current one, opened ahead of its turn */
+struct lrg_ahead {
+    const char *fn;
+    FILE *f;
+};
+
+static struct lrg_ahead ahead;
+
+static void lrg_close_ahead(void) {
+    if (ahead.f) {
+        fclose(ahead.f);
+        ahead.f = NULL;
+    }
+}
+
+/* open fn, which comes after the file about to be processed, and ask the
+   kernel to start reading it from the beginning if it is too large to be
+   read with a single read. only regular files are opened early, and any
+   failure is left for lrg_nextfile to run into and report when it is fn's
+   turn */
+static void lrg_open_ahead(const char *fn) {
+    struct lrg_input probe;
+    struct stat st;
+    int fd;
+    FILE *f;
+
+    lrg_close_ahead();
+    /* O_NONBLOCK keeps the open of a FIFO from waiting for a writer, and
+       does nothing for regular files */
+    if (!strcmp(fn, STDIN_FILE) || (fd = open(fn, O_RDONLY | O_NONBLOCK)) < 0)
+        return;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        !(f = fdopen(fd, LRG_FOPEN_MODE))) {
+        close(fd);
+        return;
+    }
+    ahead.fn = fn, ahead.f = f;
+    /* a file that fits in the read buffer takes one read anyway */
+    probe.can_seek = 1, probe.size = st.st_size;
+    if (probe.size > (lrg_off_t)lrg_choose_bufsize(
+                         &probe, st.st_blksize > 0 ? st.st_blksize : 0))
+        posix_fadvise(fd, 0, LRG_READ_AHEAD, POSIX_FADV_WILLNEED);
+}
+#endif
+
+/* process the next file. own_buf is passed on to lrg_input_open. 0 if OK */
+static int lrg_nextfile(const char *fn, int own_buf) {
+    FILE *f;
+    struct lrg_input in;
+    int returncode;
+
+    if (!fn || !strcmp(fn, STDIN_FILE)) {
+        f = stdin;
+        fn = STDIN_FILENAME_APPEARANCE;
+#if LRG_OPEN_AHEAD
+    } else if (ahead.f && ahead.fn == fn) {
+        f = ahead.f;
+        ahead.f = NULL;
+#endif
+    } else {
+        f = fopen(fn, LRG_FOPEN_MODE);
+        if (!f) {
+            lrg_perror(fn, OPER_OPEN);
+            return 1;
+        }
+    }
+
+    if (show_files && (lrg_out_write(fn, strlen(fn)) ||
+                       lrg_out_write(FILE_DISPLAY_AFTER,
+                                     sizeof(FILE_DISPLAY_AFTER) - 1))) {
+        lrg_broken_pipe();
+        if (f != stdin)
+            fclose(f);
+        return 1;
+    }
+
+#ifdef GET_FILE_FD
+    returncode = lrg_input_open(&in, fn, GET_FILE_FD(f), own_buf);
+#else
+    returncode = lrg_input_open(&in, fn, f, own_buf);
+#endif
+    if (!returncode) {
+#if LRG_INDEX
+        if (use_index && in.can_seek && in.size >= 0 && !in.whole)
+            lrg_input_index(&in, f != stdin ? fn : NULL);
+#endif
+        returncode = sample_lines     ? lrg_process_sample(&in)
+                     : lines_from_end ? lrg_process_from_end(&in)
+                                      : lrg_process(&in);
+        lrg_input_close(&in);
+    }
+
+    if (f != stdin)
+        fclose(f);
+    return returncode;
+}
+
+#if LRG_PARALLEL_FILES
+/* several files processed by several threads (--jobs), each into a sink of
+   its own. threads take the files in order and stay no more than
+   LRG_FILES_AHEAD files per thread ahead of the file being written out */
+struct lrg_file_job {
+    struct lrg_sink sink;
+    /* whether the file has been processed (1), failed (-1) or neither yet
+       (0), and whether it ran into EOF early */
+    int done, got_eof;
+};
+
+struct lrg_file_pool {
+    char **files;
+    pthread_mutex_t lock;
+    /* signaled whenever a file has been processed or written out */
+    pthread_cond_t cond;
+    /* number of files, next file to process, number of files written out */
+    int n, next, written;
+    struct lrg_file_job *jobs;
+    /* set to ask the threads to stop */
+    int stop;
+};
+
+#define LRG_FILES_AHEAD 2
+
+struct lrg_file_worker {
+    struct lrg_file_pool *pool;
+    pthread_t thread;
+    /* the output buffer of the thread */
+    char *buf;
+};
+
+static void *lrg_file_worker_main(void *arg) {
+    struct lrg_file_worker *w = arg;
+    struct lrg_file_pool *p = w->pool;
+    struct lrg_file_job *job;
+    int failed;
+
+    out_buf = w->buf;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && p->next < p->n) {
+        if (p->next - p->written >= LRG_FILES_AHEAD * jobs) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        job = &p->jobs[p->next++];
+        pthread_mutex_unlock(&p->lock);
+
+        out_sink = &job->sink, out_error = 0, got_eof = 0;
+        failed = lrg_nextfile(p->files[job - p->jobs], 1);
+        if (lrg_out_flush() && !failed) {
+            lrg_broken_pipe();
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        job->got_eof = got_eof;
+        job->done = failed ? -1 : 1;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
 
-    read_error:
-        if (UNLIKELY(read_n < 0)) {
-            /* file error */
-            lrg_perror(fn, OPER_READ);
-            return 1;
+/* write out what was kept aside for a file and free it. 0 if OK */
+static int lrg_sink_flush(struct lrg_sink *k) {
+    char tmp[BUFSIZ];
+    size_t n;
+    int err = 0;
+
+    if (k->len && lrg_out_write(k->mem, k->len))
+        goto write_error;
+    if (k->spill) {
+        rewind(k->spill);
+        while ((n = fread(tmp, 1, sizeof(tmp), k->spill)) > 0)
+            if (lrg_out_write(tmp, n))
+                goto write_error;
+        if (ferror(k->spill)) {
+            lrg_perror(TEMP_FILENAME_APPEARANCE, OPER_READ);
+            err = 1;
         }
-        if (UNLIKELY(read_n == 0 && range.last != LINENUM_MAX)) {
-            /* reached the end of the file before first or last line */
-            eof_at = linenum;
-            if (warn_noline)
-                lrg_eof_before(
-                    fn, linenum >= range.first ? range.last : range.first,
-                    eof_at);
+    }
+    lrg_sink_free(k);
+    return err;
+write_error:
+    lrg_broken_pipe();
+    lrg_sink_free(k);
+    return 1;
+}
+
+/* whether the files can be processed by several threads at once */
+static int lrg_parallel_files_ok(char **files, int n) {
+    int i;
+    /* every file needs ranges of its own with these, and --lps has
+       to write out every line as it comes */
+    if (jobs < 2 || n < 2 || lines_from_end || sample_lines
+#if LRG_SUPPORT_LPS
+        || lps_enable
+#endif
+    )
+        return 0;
+    /* stdin cannot be read by two threads at once */
+    for (i = 0; i < n; ++i)
+        if (!strcmp(files[i], STDIN_FILE))
+            return 0;
+    return 1;
+}
+
+/* process several files with several threads, writing out the output of
+   each in order, as if they were processed one after another. returns 0 if
+   OK, 1 on error, or -1 if the threads could not be set up */
+static int lrg_process_parallel_files(char **files, int n) {
+    struct lrg_file_pool p;
+    struct lrg_file_worker *workers;
+    int i, n_workers = jobs < n ? jobs : n, n_bufs = 0, started = 0,
+           failed = 0, returncode = -1;
+
+    p.files = files, p.n = n, p.next = 0, p.written = 0, p.stop = 0;
+    p.jobs = lrg_malloc(n * sizeof(*p.jobs));
+    workers = lrg_malloc(n_workers * sizeof(*workers));
+    if (!p.jobs || !workers)
+        goto fail_alloc;
+    for (; n_bufs < n_workers; ++n_bufs) {
+        workers[n_bufs].pool = &p;
+        if (!(workers[n_bufs].buf = lrg_malloc(LRG_OUT_BUFSIZE)))
+            goto fail_alloc;
+    }
+    if (pthread_mutex_init(&p.lock, NULL))
+        goto fail_alloc;
+    if (pthread_cond_init(&p.cond, NULL))
+        goto fail_cond;
+    for (i = 0; i < n; ++i) {
+        p.jobs[i].sink.mem = NULL, p.jobs[i].sink.len = 0;
+        p.jobs[i].sink.spill = NULL, p.jobs[i].done = 0;
+    }
+
+    for (i = 0; i < n_workers; ++i)
+        if (!pthread_create(&workers[started].thread, NULL,
+                            &lrg_file_worker_main, &workers[started]))
+            ++started;
+
+    for (i = 0; started && i < n; ++i) {
+        pthread_mutex_lock(&p.lock);
+        while (!p.jobs[i].done)
+            pthread_cond_wait(&p.cond, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+
+        /* what a file wrote before it failed is written out too, and then
+           we stop, like without threads */
+        if (p.jobs[i].got_eof)
             got_eof = 1;
-            if (error_on_eof)
-                return 0;
-            read_n = buf_end - tmpbuf;
-        }
+        failed = lrg_sink_flush(&p.jobs[i].sink) || p.jobs[i].done < 0;
+
+        pthread_mutex_lock(&p.lock);
+        p.written = i + 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        if (failed)
+            break;
     }
-    return 0;
+    if (started)
+        returncode = failed;
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < n; ++i)
+        lrg_sink_free(&p.jobs[i].sink);
+
+    pthread_cond_destroy(&p.cond);
+fail_cond:
+    pthread_mutex_destroy(&p.lock);
+fail_alloc:
+    for (i = 0; i < n_bufs; ++i)
+        lrg_free(workers[i].buf);
+    lrg_free(workers);
+    lrg_free(p.jobs);
+    return returncode;
+}
+#endif
+
+/* ========================================================= */
+/*                      counting lines                       */
+/* ========================================================= */
+
+/* print the number of lines in each file instead of any lines (--count) */
+static int count_lines = 0;
+
+/* the number of lines in an input, from an index or the length of the lines
+   if possible, else by reading all of it. split says whether the counting
+   may be split up between several threads. 0 if OK */
+static int lrg_count_input(struct lrg_input *in, int split,
+                           linenum_t *lines) {
+    lrg_off_t off = 0;
+    linenum_t n = 0;
+    if (in->can_seek && in->size >= 0) {
+        int known = lrg_known_lines(in, lines);
+        if (known >= 0)
+            return known;
+    }
+#if LRG_THREADS
+    if (split && jobs > 1 && in->can_seek && in->size >= 0 &&
+        in->size >= (lrg_off_t)jobs * LRG_JOBS_CHUNK)
+        off = lrg_count_parallel(in, LINENUM_MAX, &n);
+#endif
+    (void)split;
+    return lrg_lines_after(in, off, n, lines);
 }
 
-static int lrg_nextfile(const char *fn) {
+/* count the lines in a file, like lrg_nextfile. own_buf is passed on to
+   lrg_input_open. 0 if OK */
+static int lrg_count_file(const char *fn, int own_buf, int split,
+                          linenum_t *lines) {
     FILE *f;
+    struct lrg_input in;
     int returncode;
 
     if (!fn || !strcmp(fn, STDIN_FILE)) {
         f = stdin;
         fn = STDIN_FILENAME_APPEARANCE;
     } else {
-        f = fopen(fn, LRG_BACKWARD_SCAN ? "rb" : "r");
+        f = fopen(fn, LRG_FOPEN_MODE);
         if (!f) {
             lrg_perror(fn, OPER_OPEN);
             return 1;
         }
     }
 
-    if (show_files)
-        printf(FILE_DISPLAY_FMT, fn);
-
-    returncode = lrg_processfile(fn, f);
+#ifdef GET_FILE_FD
+    returncode = lrg_input_open(&in, fn, GET_FILE_FD(f), own_buf);
+#else
+    returncode = lrg_input_open(&in, fn, f, own_buf);
+#endif
+    if (!returncode) {
+#if LRG_INDEX
+        if (use_index && in.can_seek && in.size >= 0 && !in.whole)
+            lrg_input_index(&in, f != stdin ? fn : NULL);
+#endif
+        returncode = lrg_count_input(&in, split, lines);
+        lrg_input_close(&in);
+    }
 
     if (f != stdin)
         fclose(f);
     return returncode;
 }
 
+#if LRG_THREADS
+/* whole files counted by several threads (--jobs). threads take the files
+   in order, so that the counts can be printed as they complete */
+struct lrg_file_counter {
+    char **files;
+    pthread_mutex_t lock;
+    /* signaled whenever a file has been counted */
+    pthread_cond_t cond;
+    /* number of files, next file to count */
+    int n, next;
+    /* lines in each file, and whether it has been counted (1), could not be
+       counted (-1) or neither yet (0) */
+    linenum_t *lines;
+    int *done;
+    /* set to ask the threads to stop */
+    int stop;
+};
+
+static void *lrg_file_counter_main(void *arg) {
+    struct lrg_file_counter *c = arg;
+    linenum_t lines = 0;
+    int i, failed;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop && c->next < c->n) {
+        i = c->next++;
+        pthread_mutex_unlock(&c->lock);
+
+        failed = lrg_count_file(c->files[i], 1, 0, &lines);
+
+        pthread_mutex_lock(&c->lock);
+        c->lines[i] = lines;
+        c->done[i] = failed ? -1 : 1;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* count and print the lines in several files with several threads. returns
+   0 if OK, 1 on error, or -1 if the threads could not be set up */
+static int lrg_count_parallel_files(char **files, int n, linenum_t *total) {
+    struct lrg_file_counter c;
+    pthread_t *threads;
+    int i, started = 0, returncode = -1;
+
+    c.files = files, c.n = n, c.next = 0, c.stop = 0;
+    c.lines = lrg_malloc(n * sizeof(*c.lines));
+    c.done = lrg_malloc(n * sizeof(*c.done));
+    threads = lrg_malloc(jobs * sizeof(*threads));
+    if (!c.lines || !c.done || !threads)
+        goto fail_alloc;
+    if (pthread_mutex_init(&c.lock, NULL))
+        goto fail_alloc;
+    if (pthread_cond_init(&c.cond, NULL))
+        goto fail_cond;
+    for (i = 0; i < n; ++i)
+        c.done[i] = 0;
+
+    for (i = 0; i < jobs && i < n; ++i)
+        if (!pthread_create(&threads[started], NULL, &lrg_file_counter_main,
+                            &c))
+            ++started;
+
+    pthread_mutex_lock(&c.lock);
+    for (i = 0; started && i < n; ++i) {
+        while (!c.done[i])
+            pthread_cond_wait(&c.cond, &c.lock);
+        /* stop at the first file that fails, like without threads */
+        if (c.done[i] < 0)
+            break;
+        printf(COUNT_DISPLAY_FMT, c.lines[i],
+               strcmp(files[i], STDIN_FILE) ? files[i]
+                                            : STDIN_FILENAME_APPEARANCE);
+        *total += c.lines[i];
+    }
+    if (started)
+        returncode = i < n;
+    c.stop = 1;
+    pthread_mutex_unlock(&c.lock);
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&c.cond);
+fail_cond:
+    pthread_mutex_destroy(&c.lock);
+fail_alloc:
+    lrg_free(threads);
+    lrg_free(c.done);
+    lrg_free(c.lines);
+    return returncode;
+}
+#endif
+
+/* count and print the lines in every file, and their total if there is more
+   than one. no files means stdin. 0 if OK */
+static int lrg_count_files(char **files, int n) {
+    linenum_t lines, total = 0;
+    int i;
+
+    if (!n) {
+        if (lrg_count_file(NULL, 0, 1, &lines))
+            return 1;
+        printf(COUNT_DISPLAY_FMT, lines, STDIN_FILENAME_APPEARANCE);
+        return 0;
+    }
+#if LRG_THREADS
+    if (jobs > 1 && n > 1 &&
+        (i = lrg_count_parallel_files(files, n, &total)) >= 0) {
+        if (i)
+            return 1;
+    } else
+#endif
+        for (i = 0; i < n; ++i) {
+            if (lrg_count_file(files[i], 0, 1, &lines))
+                return 1;
+            printf(COUNT_DISPLAY_FMT, lines,
+                   strcmp(files[i], STDIN_FILE) ? files[i]
+                                                : STDIN_FILENAME_APPEARANCE);
+            total += lines;
+        }
+    if (n > 1)
+        printf(COUNT_DISPLAY_FMT, total, COUNT_TOTAL_TEXT);
+    return 0;
+}
+
 /* ========================================================= */
 /*              line number syntax parsing code              */
 /* ========================================================= */
@@ -888,21 +5158,44 @@ static int lrg_read_linenum(char *str, char **endptr, linenum_t *out,
     return allow_zero || result != 0;
 }
 
-/* 0 = ok, < 0 = fail, > 0 = end */
+/* like lrg_read_linenum, but also takes $ for the last line and $-N for the
+   N-th line before it, in which case *from_end is set and *out is N */
+static int lrg_read_line(char *str, char **endptr, linenum_t *out,
+                         linenum_t fallback, int *from_end) {
+    while (isspace(*str))
+        ++str;
+    if (*str != '$') {
+        *from_end = 0;
+        return lrg_read_linenum(str, endptr, out, fallback, 0);
+    }
+    *from_end = 1, *out = 0, *endptr = str + 1;
+    if (str[1] == '-' && isdigit(str[2])) {
+        errno = 0;
+        *out = STR_TO_LINENUM(str + 2, endptr, 10);
+        if (*out == LINENUM_MAX && errno == ERANGE)
+            return -1;
+    }
+    return 1;
+}
+
+/* 0 = ok, < 0 = fail, > 0 = end. *from_end is set to LRG_FIRST_FROM_END and
+   LRG_LAST_FROM_END as needed, and *step to the S of a trailing :S or 1 */
 static int lrg_next_linerange(char **RESTRICT ptr, linenum_t *RESTRICT start,
-                              linenum_t *RESTRICT end) {
+                              linenum_t *RESTRICT end, int *from_end,
+                              linenum_t *step) {
     char *str = *ptr, *endptr;
     linenum_t line0;
+    int end0, end1;
 
     if (!*str) /* end */
         return 1;
     /* must have valid line0 */
-    if (lrg_read_linenum(str, &endptr, &line0, 0, 0) <= 0)
+    if (lrg_read_line(str, &endptr, &line0, 0, &end0) <= 0)
         return -1;
 
     if (*endptr == '-') { /* 50-100... */
         linenum_t line1;
-        if (lrg_read_linenum(endptr + 1, &endptr, &line1, LINENUM_MAX, 0) < 0)
+        if (lrg_read_line(endptr + 1, &endptr, &line1, LINENUM_MAX, &end1) < 0)
             return -1;
         *start = line0, *end = line1;
 
@@ -910,15 +5203,32 @@ static int lrg_next_linerange(char **RESTRICT ptr, linenum_t *RESTRICT start,
         linenum_t linec;
         if (lrg_read_linenum(endptr + 1, &endptr, &linec, 3, 1) < 0)
             return -1;
-        *start = line0 > linec ? line0 - linec : 1;
-        if (line0 + linec < line0) /* overflow protection */
-            return -1;
-        *end = line0 + linec;
+        if (end0) { /* $-50~10, counting the other way */
+            if (line0 + linec < line0)
+                return -1;
+            *start = line0 + linec, *end = line0 > linec ? line0 - linec : 0;
+        } else {
+            *start = line0 > linec ? line0 - linec : 1;
+            if (line0 + linec < line0) /* overflow protection */
+                return -1;
+            *end = line0 + linec;
+        }
+        end1 = end0;
 
     } else {
-        *start = line0, *end = line0;
+        *start = line0, *end = line0, end1 = end0;
     }
 
+    /* up to $ is up to the end of the file, which needs no counting */
+    if (end1 && !*end)
+        *end = LINENUM_MAX, end1 = 0;
+    *from_end = (end0 ? LRG_FIRST_FROM_END : 0) | (end1 ? LRG_LAST_FROM_END : 0);
+
+    *step = 1;
+    if (*endptr == ':' && /* 1-100:10, every 10th line */
+        lrg_read_linenum(endptr + 1, &endptr, step, 0, 0) <= 0)
+        return -1;
+
     if (*endptr == ',') /* 2,5-6,10~3,... */
         *endptr++ = 0;  /* for printing .text later on error */
     else if (*endptr)   /* only comma or end of string allowed */
@@ -930,56 +5240,408 @@ static int lrg_next_linerange(char **RESTRICT ptr, linenum_t *RESTRICT start,
 
 static void lrg_free_linebuf(void) { lrg_free(linesbuf); }
 
+/* adds a range to the end of the line range buffer. 0 if OK */
+static int lrg_push_linerange(linenum_t first, linenum_t last,
+                              const char *text) {
+    if (n_linesbuf == c_linesbuf) {
+        /* don't try to call realloc on the static buffer! */
+        if (linesbuf == st_linesbuf) {
+            linesbuf = lrg_malloc(sizeof(struct lrg_linerange) *
+                                  (c_linesbuf *= 2));
+            if (!linesbuf) {
+                lrg_alloc_fail();
+                return 1;
+            }
+            memcpy(linesbuf, st_linesbuf,
+                   sizeof(struct lrg_linerange) * n_linesbuf);
+            atexit(&lrg_free_linebuf);
+
+        } else {
+            struct lrg_linerange *newptr = lrg_realloc(
+                linesbuf, sizeof(struct lrg_linerange) * (c_linesbuf *= 2));
+            if (!newptr) {
+                lrg_alloc_fail();
+                return 1;
+            }
+            linesbuf = newptr;
+        }
+    }
+
+    linesbuf[n_linesbuf].first = first;
+    linesbuf[n_linesbuf].last = last;
+    linesbuf[n_linesbuf].text = text;
+    linesbuf[n_linesbuf].from_end = 0;
+    linesbuf[n_linesbuf].step = 1;
+    ++n_linesbuf;
+    return 0;
+}
+
 static int lrg_parse_lines(char *ln) {
     char *oldptr = ln;
-    int pl = 0;
-    linenum_t l0 = 0, l1 = 0;
+    int pl = 0, from_end = 0;
+    linenum_t l0 = 0, l1 = 0, step = 1;
 
-    while ((pl = lrg_next_linerange(&ln, &l0, &l1)) <= 0) {
+    while ((pl = lrg_next_linerange(&ln, &l0, &l1, &from_end, &step)) <= 0) {
         if (pl < 0) {
             lrg_invalid_range(oldptr);
             return 1;
         }
+        if (lrg_push_linerange(l0, l1, oldptr))
+            return 1;
+        linesbuf[n_linesbuf - 1].from_end = from_end;
+        linesbuf[n_linesbuf - 1].step = step;
+        oldptr = ln;
+    }
 
-        if (n_linesbuf == c_linesbuf) {
-            /* don't try to call realloc on the static buffer! */
-            if (linesbuf == st_linesbuf) {
-                linesbuf = lrg_malloc(sizeof(struct lrg_linerange) *
-                                      (c_linesbuf *= 2));
-                if (!linesbuf) {
-                    lrg_alloc_fail();
-                    return 1;
-                }
-                memcpy(linesbuf, st_linesbuf,
-                       sizeof(struct lrg_linerange) * n_linesbuf);
-                atexit(&lrg_free_linebuf);
+    return 0;
+}
 
-            } else {
-                struct lrg_linerange *newptr = lrg_realloc(
-                    linesbuf, sizeof(struct lrg_linerange) * (c_linesbuf *= 2));
-                if (!newptr) {
-                    lrg_alloc_fail();
-                    return 1;
+static void lrg_free_intervals(void) { lrg_free(intervals); }
+
+/* adds a plain range of --ranges-from. 0 if OK */
+static int lrg_push_interval(linenum_t first, linenum_t last) {
+    if (n_intervals == c_intervals) {
+        size_t c = c_intervals ? c_intervals * 2 : LRG_LINEBUFSIZE;
+        struct lrg_interval *newptr;
+        if (c > (size_t)-1 / sizeof(*intervals) ||
+            !(newptr = lrg_realloc(intervals, c * sizeof(*intervals)))) {
+            lrg_alloc_fail();
+            return 1;
+        }
+        if (!intervals)
+            atexit(&lrg_free_intervals);
+        intervals = newptr, c_intervals = c;
+    }
+    intervals[n_intervals].first = first;
+    intervals[n_intervals].last = last;
+    ++n_intervals;
+    return 0;
+}
+
+/* moves the intervals read so far to the line range buffer, once a range that
+   needs more than an interval turns up. 0 if OK */
+static int lrg_intervals_to_linesbuf(void) {
+    size_t i;
+    for (i = 0; i < n_intervals; ++i)
+        if (lrg_push_linerange(intervals[i].first, intervals[i].last,
+                               ranges_fn))
+            return 1;
+    lrg_free(intervals);
+    intervals = NULL, n_intervals = c_intervals = 0;
+    return 0;
+}
+
+/* adds a range read by lrg_read_ranges. 0 if OK, > 0 if it is invalid, < 0 on
+   other errors */
+static int lrg_push_read_range(char *tok) {
+    char *ptr = tok;
+    linenum_t l0, l1, step;
+    int from_end;
+
+    if (lrg_next_linerange(&ptr, &l0, &l1, &from_end, &step)) {
+        lrg_invalid_range(tok);
+        return 1;
+    }
+    /* only plain ranges are intervals, and only if no others came before */
+    if (!from_end && step == 1 && (intervals || !n_linesbuf))
+        return l0 <= l1 && lrg_push_interval(l0, l1) ? -1 : 0;
+    if (intervals && lrg_intervals_to_linesbuf())
+        return -1;
+    if (from_end || l0 <= l1) {
+        if (lrg_push_linerange(l0, l1, ranges_fn))
+            return -1;
+        linesbuf[n_linesbuf - 1].from_end = from_end;
+        linesbuf[n_linesbuf - 1].step = step;
+    }
+    return 0;
+}
+
+/* for --ranges-from. reads ranges from a file, separated by commas or
+   whitespace. 0 if OK, > 0 if a range is invalid, < 0 on other errors */
+static int lrg_read_ranges(const char *fn) {
+    FILE *f = strcmp(fn, STDIN_FILE) ? fopen(fn, "r") : stdin;
+    char buf[BUFSIZ], tok[64];
+    size_t len = 0, n, i;
+    int result = 0;
+
+    ranges_fn = fn;
+    if (!f) {
+        lrg_perror(fn, OPER_OPEN);
+        return -1;
+    }
+    /* read in blocks, since there may be millions of ranges */
+    do {
+        n = fread(buf, 1, sizeof(buf), f);
+        for (i = 0; i < n; ++i) {
+            int c = (unsigned char)buf[i];
+            if (c != ',' && !isspace(c)) {
+                if (len == sizeof(tok) - 1) { /* far too long to be valid */
+                    tok[len] = 0;
+                    lrg_invalid_range(tok);
+                    result = 1;
+                    goto done;
                 }
-                linesbuf = newptr;
+                tok[len++] = (char)c;
+            } else if (len) {
+                tok[len] = 0, len = 0;
+                if ((result = lrg_push_read_range(tok)))
+                    goto done;
             }
         }
+    } while (n == sizeof(buf));
+
+    if (ferror(f)) {
+        lrg_perror(fn, OPER_READ);
+        result = -1;
+    } else if (len) {
+        tok[len] = 0;
+        result = lrg_push_read_range(tok);
+    }
+done:
+    if (f != stdin)
+        fclose(f);
+    return result;
+}
 
-        linesbuf[n_linesbuf].first = l0;
-        linesbuf[n_linesbuf].last = l1;
-        linesbuf[n_linesbuf].text = oldptr;
-        ++n_linesbuf;
+static int lrg_range_compare(const void *a, const void *b) {
+    linenum_t x = ((const struct lrg_linerange *)a)->first,
+              y = ((const struct lrg_linerange *)b)->first;
+    return x < y ? -1 : x > y;
+}
 
-        oldptr = ln;
+/* sorts the ranges and merges those that overlap or touch, so that every line
+   is read once and in one pass. ranges with a step are left as they are */
+static void lrg_merge_ranges(void) {
+    size_t i, j;
+    qsort(linesbuf, n_linesbuf, sizeof(*linesbuf), &lrg_range_compare);
+    for (i = j = 0; i < n_linesbuf; ++i) {
+        if (linesbuf[i].first > linesbuf[i].last)
+            continue;
+        if (j && linesbuf[i].step == 1 && linesbuf[j - 1].step == 1 &&
+            linesbuf[i].first - 1 <= linesbuf[j - 1].last) {
+            if (linesbuf[i].last > linesbuf[j - 1].last)
+                linesbuf[j - 1].last = linesbuf[i].last;
+        } else
+            linesbuf[j++] = linesbuf[i];
+    }
+    n_linesbuf = j;
+}
+
+static int lrg_interval_compare(const void *a, const void *b) {
+    linenum_t x = ((const struct lrg_interval *)a)->first,
+              y = ((const struct lrg_interval *)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+/* sorts the intervals and merges those that overlap or touch */
+static void lrg_merge_intervals(void) {
+    size_t i, j;
+    qsort(intervals, n_intervals, sizeof(*intervals), &lrg_interval_compare);
+    for (i = j = 0; i < n_intervals; ++i) {
+        if (j && intervals[i].first - 1 <= intervals[j - 1].last) {
+            if (intervals[i].last > intervals[j - 1].last)
+                intervals[j - 1].last = intervals[i].last;
+        } else
+            intervals[j++] = intervals[i];
+    }
+    n_intervals = j;
+}
+
+/* adds the lines of a range from first to last, starting from the first of
+   them that is in the range. 0 if OK */
+static int lrg_push_part(const struct lrg_linerange *range, linenum_t first,
+                         linenum_t last) {
+    first = lrg_next_in_range(range, first);
+    if (first > last)
+        return 0;
+    if (lrg_push_linerange(first, last, range->text))
+        return 1;
+    linesbuf[n_linesbuf - 1].step = range->step;
+    return 0;
+}
+
+/* for --unique. takes out the lines of every range that an earlier range
+   already has, which may split it into several ranges. the lines of a range
+   with a step are too scattered to be taken out of later ranges. 0 if OK */
+static int lrg_unique_lines(void) {
+    size_t n = n_linesbuf, n_cov = 0, i, j, k;
+    /* a copy of the ranges, then the lines covered so far as ranges sorted
+       by line number that neither overlap nor touch */
+    struct lrg_linerange *src = lrg_malloc(sizeof(*src) * (2 * n + 1)),
+                         *cov = src + n;
+    if (!src) {
+        lrg_alloc_fail();
+        return 1;
+    }
+    memcpy(src, linesbuf, sizeof(*src) * n);
+    n_linesbuf = 0;
+
+    for (i = 0; i < n; ++i) {
+        linenum_t first = src[i].first, last = src[i].last, line = first;
+        int covered = 0;
+        if (first > last)
+            continue;
+        /* the gaps between the covered lines */
+        for (j = 0; j < n_cov && cov[j].first <= last; ++j) {
+            if (cov[j].last < line)
+                continue;
+            if (cov[j].first > line &&
+                lrg_push_part(&src[i], line, cov[j].first - 1))
+                goto fail;
+            if (cov[j].last >= last) {
+                covered = 1;
+                break;
+            }
+            line = cov[j].last + 1;
+        }
+        if (!covered && lrg_push_part(&src[i], line, last))
+            goto fail;
+        if (src[i].step > 1)
+            continue;
+
+        /* then cover this range, merging it with those it overlaps */
+        for (j = 0; j < n_cov && cov[j].last < first - 1; ++j)
+            ;
+        for (k = j; k < n_cov && cov[k].first - 1 <= last; ++k)
+            ;
+        if (k > j) {
+            if (cov[j].first < first)
+                first = cov[j].first;
+            if (cov[k - 1].last > last)
+                last = cov[k - 1].last;
+        }
+        memmove(cov + j + 1, cov + k, sizeof(*cov) * (n_cov - k));
+        n_cov = n_cov - (k - j) + 1;
+        cov[j].first = first, cov[j].last = last;
     }
+    lrg_free(src);
+    return 0;
+fail:
+    lrg_free(src);
+    return 1;
+}
+
+/* decides whether the ranges are in ascending order, and if not, how many
+   lines need to be kept aside to read them in one pass. those are the lines
+   of every range that an earlier range reads past */
+static void lrg_plan_lines(void) {
+    size_t i;
+    linenum_t reach = 0, lines;
+    ranges_ascending = 1, reorder_lines = 0;
+    for (i = 0; i < n_linesbuf; ++i) {
+        struct lrg_linerange range = linesbuf[i];
+        if (range.first > range.last)
+            continue;
+        if (range.first <= reach) {
+            ranges_ascending = 0;
+            lines = ((range.last < reach ? range.last : reach) - range.first) /
+                        range.step +
+                    1;
+            reorder_lines = lines > LINENUM_MAX - reorder_lines
+                                ? LINENUM_MAX
+                                : reorder_lines + lines;
+        }
+        if (range.last > reach)
+            reach = range.last;
+    }
+}
+
+/* gets the ranges ready to be read. 0 if OK */
+static int lrg_prepare_lines(void) {
+    size_t i;
+    if (intervals)
+        lrg_merge_intervals();
+    else if (ranges_from_file)
+        lrg_merge_ranges();
+    else if (unique_lines && lrg_unique_lines())
+        return 1;
+    /* a range with a step ends at the last line in it */
+    for (i = 0; i < n_linesbuf; ++i)
+        if (linesbuf[i].first <= linesbuf[i].last &&
+            linesbuf[i].last != LINENUM_MAX)
+            linesbuf[i].last -=
+                (linesbuf[i].last - linesbuf[i].first) % linesbuf[i].step;
+    lrg_plan_lines();
+    return 0;
+}
 
+static void lrg_free_ranges_given(void) { lrg_free(ranges_given); }
+
+/* if any range counts lines from the end, sets aside the ranges as given and
+   finds out how many of the last lines of each file are needed for them. 0 if
+   OK */
+static int lrg_find_lines_from_end(void) {
+    size_t i;
+    for (i = 0; i < n_linesbuf; ++i) {
+        struct lrg_linerange range = linesbuf[i];
+        if (range.from_end & LRG_FIRST_FROM_END &&
+            range.first >= lines_from_end)
+            lines_from_end = range.first + (range.first < LINENUM_MAX);
+        if (range.from_end & LRG_LAST_FROM_END && range.last >= lines_from_end)
+            lines_from_end = range.last + (range.last < LINENUM_MAX);
+        if (lrg_counts_from_start(&range))
+            ranges_mixed = 1;
+    }
+    if (!lines_from_end)
+        return 0;
+    ranges_given = lrg_malloc((n_linesbuf + 1) * sizeof(*ranges_given));
+    if (!ranges_given) {
+        lrg_alloc_fail();
+        return 1;
+    }
+    atexit(&lrg_free_ranges_given);
+    memcpy(ranges_given, linesbuf, sizeof(*ranges_given) * n_linesbuf);
+    n_ranges_given = n_linesbuf;
     return 0;
 }
 
+/* turns the ranges that count lines from the end into ones that do not, for
+   a file with the given number of lines, and gets them ready. 0 if OK */
+static int lrg_resolve_lines(linenum_t lines) {
+    size_t i;
+    n_linesbuf = 0;
+    for (i = 0; i < n_ranges_given; ++i) {
+        struct lrg_linerange range = ranges_given[i];
+        if (range.from_end & LRG_FIRST_FROM_END)
+            range.first = range.first < lines ? lines - range.first : 1;
+        if (range.from_end & LRG_LAST_FROM_END)
+            range.last = range.last < lines ? lines - range.last : 0;
+        if (lrg_push_linerange(range.first, range.last, range.text))
+            return 1;
+        linesbuf[n_linesbuf - 1].step = range.step;
+    }
+    return lrg_prepare_lines();
+}
+
 /* ========================================================= */
 /*                     main program code                     */
 /* ========================================================= */
 
+/* the largest accepted --buffer-size */
+#define LRG_BUFSIZE_LIMIT (INT_MAX / 2 + 1)
+
+/* parse a size in bytes, with an optional K, M or G suffix. 0 if OK */
+static int lrg_parse_size(const char *str, size_t *out) {
+    char *endptr;
+    unsigned long result, mul = 1;
+    if (!isdigit(*str))
+        return -1;
+    errno = 0;
+    result = strtoul(str, &endptr, 10);
+    if (errno == ERANGE)
+        return -1;
+    if (*endptr == 'K' || *endptr == 'k')
+        mul = 1UL << 10, ++endptr;
+    else if (*endptr == 'M' || *endptr == 'm')
+        mul = 1UL << 20, ++endptr;
+    else if (*endptr == 'G' || *endptr == 'g')
+        mul = 1UL << 30, ++endptr;
+    if (*endptr || !result || result > LRG_BUFSIZE_LIMIT / mul)
+        return -1;
+    *out = result * mul;
+    return 0;
+}
+
 #if LRG_DOS || LRG_WINDOWS
 #define LRG_IS_SWITCH(x) (((x)[0] == '-' || (x)[0] == '/') && ((x)[1]))
 #define LRG_IS_LONG_SWITCH(x) ((x)[0] == '-' && (x)[1] == '-')
@@ -989,8 +5651,12 @@ static int lrg_parse_lines(char *ln) {
 #endif
 
 int main(int argc, char *argv[]) {
-    int flag_ok = 1, i, fend = 0, inputLines = 0;
+    int flag_ok = 1, i, fend = 0, inputLines = 0, built_index = 0, seeded = 0,
+        ranges_stdin = 0, returncode = EXITCODE_OK;
     myname = argv[0];
+#if LRG_SIMD_MEMCNT
+    lrg_memcnt_init();
+#endif
 
     /* ensure numbers show up in C locale */
     setlocale(LC_NUMERIC, "C");
@@ -1012,6 +5678,44 @@ int main(int argc, char *argv[]) {
                     warn_noline = 1;
                 } else if (!strcmp(rest, "error-on-eof")) {
                     error_on_eof = 1;
+                } else if (!strcmp(rest, "unique")) {
+                    unique_lines = 1;
+                } else if (!strcmp(rest, "ranges-from")) {
+                    if (++i >= argc) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    if ((ranges_from_file = lrg_read_ranges(argv[i])))
+                        return ranges_from_file < 0 ? EXITCODE_ERR
+                                                    : EXITCODE_USE;
+                    /* every argument that is not an option is a file now */
+                    inputLines = i, ranges_from_file = 1;
+                    if (!strcmp(argv[i], STDIN_FILE))
+                        ranges_stdin = 1;
+                } else if (!strcmp(rest, "sample")) {
+                    char *endptr;
+                    errno = 0;
+                    if (++i >= argc || !isdigit(*argv[i]) ||
+                        !(sample_lines = STR_TO_LINENUM(argv[i], &endptr, 10)) ||
+                        *endptr || errno) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    inputLines = i;
+                } else if (!strcmp(rest, "count")) {
+                    /* every argument that is not an option is a file now */
+                    inputLines = i, count_lines = 1;
+                } else if (!strcmp(rest, "seed")) {
+                    char *endptr;
+                    unsigned long seed;
+                    errno = 0;
+                    if (++i >= argc || !isdigit(*argv[i]) ||
+                        (seed = strtoul(argv[i], &endptr, 10), *endptr) ||
+                        errno) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    lrg_random_seed(seed), seeded = 1;
                 } else if (!strcmp(rest, "lps") ||
                            !strcmp(rest, "lines-per-second")) {
 #if LRG_SUPPORT_LPS
@@ -1026,6 +5730,83 @@ int main(int argc, char *argv[]) {
 #else
                     lrg_opts_error(OPT_ERR_UNSUP, rest);
                     return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "buffer-size")) {
+                    if (++i >= argc || lrg_parse_size(argv[i], &buffer_size)) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                } else if (!strcmp(rest, "threads-io")) {
+#if LRG_THREADS
+                    threads_io = 1;
+#else
+                    lrg_opts_error(OPT_ERR_UNSUP, rest);
+                    return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "threads-out")) {
+#if LRG_THREADS
+                    threads_out = 1;
+#else
+                    lrg_opts_error(OPT_ERR_UNSUP, rest);
+                    return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "jobs")) {
+#if LRG_THREADS
+                    char *endptr;
+                    long n = 0;
+                    errno = 0;
+                    if (++i >= argc || !isdigit(*argv[i]) ||
+                        (n = strtol(argv[i], &endptr, 10)) < 1 ||
+                        n > LRG_JOBS_MAX || *endptr || errno) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    jobs = (int)n;
+#else
+                    lrg_opts_error(OPT_ERR_UNSUP, rest);
+                    return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "record-size")) {
+#if LRG_RECORDS
+                    char *endptr;
+                    if (++i >= argc) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    errno = 0;
+                    if (!strcmp(argv[i], "auto"))
+                        record_size = LRG_RECORD_AUTO;
+                    else if (!isdigit(*argv[i]) ||
+                             !(record_size = strtoul(argv[i], &endptr, 10)) ||
+                             *endptr || errno ||
+                             record_size == LRG_RECORD_AUTO) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+#else
+                    lrg_opts_error(OPT_ERR_UNSUP, rest);
+                    return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "build-index")) {
+#if LRG_INDEX
+                    if (++i >= argc) {
+                        lrg_opts_error(OPT_ERR_PARAM, rest);
+                        return EXITCODE_USE;
+                    }
+                    if (lrg_index_build(argv[i]))
+                        return EXITCODE_ERR;
+                    built_index = 1;
+#else
+                    lrg_opts_error(OPT_ERR_UNSUP, rest);
+                    return EXITCODE_USE;
+#endif
+                } else if (!strcmp(rest, "no-index")) {
+#if LRG_INDEX
+                    use_index = 0;
+#endif
+                } else if (!strcmp(rest, "mmap")) {
+#if LRG_MMAP
+                    map_input = 1;
 #endif
                 } else if (!strcmp(rest, "help")) {
                     lrg_printhelp();
@@ -1070,23 +5851,86 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (!n_linesbuf) {
+    if (sample_lines || count_lines
+            ? n_linesbuf || ranges_from_file || (sample_lines && count_lines)
+            : !n_linesbuf && !ranges_from_file) {
+        if (built_index && !fend)
+            return EXITCODE_OK;
         lrg_showusage();
         return EXITCODE_USE;
     }
+    if (ranges_stdin) {
+        /* the ranges took all of stdin, there would be nothing left */
+        for (i = 0; i < fend && strcmp(argv[i], STDIN_FILE); ++i)
+            ;
+        if (!fend || i < fend) {
+            lrg_opts_error(OPT_ERR_STDIN, "ranges-from");
+            return EXITCODE_USE;
+        }
+    }
+    if (!seeded) {
+#if LRG_POSIX
+        lrg_random_seed((unsigned long)time(NULL) ^
+                        ((unsigned long)getpid() << 16));
+#else
+        lrg_random_seed((unsigned long)time(NULL) ^ (unsigned long)clock());
+#endif
+    }
+
+    /* ranges counting from the end are only known for each file */
+    if (lrg_find_lines_from_end() || (!lines_from_end && lrg_prepare_lines()))
+        return EXITCODE_ERR;
+
+#if LRG_ZERO_COPY
+    lrg_zero_copy_init();
+#endif
+#if LRG_INDEX
+    if (use_index)
+        lrg_index_init();
+#endif
+
+    if (count_lines)
+        return lrg_count_files(argv, fend) ? EXITCODE_ERR : EXITCODE_OK;
+
+#if LRG_THREADS
+    if (threads_out)
+        out_writer = lrg_writer_open();
+#endif
 
     if (!fend) { /* no input files */
-        if (lrg_nextfile(NULL))
-            return EXITCODE_ERR;
+        if (lrg_nextfile(NULL, 0))
+            returncode = EXITCODE_ERR;
     } else {
-        for (i = 0; i < fend; ++i) {
-            if (lrg_nextfile(argv[i]))
-                return EXITCODE_ERR;
-        }
+#if LRG_PARALLEL_FILES
+        if (lrg_parallel_files_ok(argv, fend) &&
+            (i = lrg_process_parallel_files(argv, fend)) >= 0) {
+            if (i)
+                returncode = EXITCODE_ERR;
+        } else
+#endif
+            for (i = 0; i < fend; ++i) {
+#if LRG_OPEN_AHEAD
+                if (i + 1 < fend)
+                    lrg_open_ahead(argv[i + 1]);
+#endif
+                if (lrg_nextfile(argv[i], 0)) {
+                    returncode = EXITCODE_ERR;
+                    break;
+                }
+            }
+#if LRG_OPEN_AHEAD
+        lrg_close_ahead();
+#endif
+    }
+
+    /* whatever was written before an error is still written out */
+    if (lrg_out_finish() && returncode == EXITCODE_OK) {
+        lrg_broken_pipe();
+        returncode = EXITCODE_ERR;
     }
 
     if (error_on_eof && got_eof)
         return EXITCODE_ERR;
 
-    return EXITCODE_OK;
+    return returncode;
 }
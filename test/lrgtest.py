@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 import os.path
 import os
+import re
 import subprocess
 import random
 import math
@@ -87,10 +88,19 @@ def colorPrint(color, *a, **kw):
         print(*a, **kw)
 
 
-def makeExpectedLrgOutput(s, pipe):
+def makeExpectedLrgOutput(s):
     q = []
     expect_error = False
     for t in s.split(","):
+        step, r = 1, []
+        if ":" in t:
+            t, step = t.split(":")
+            try:
+                step = int(step)
+            except ValueError:
+                return ([], True)
+            if step < 1:
+                return ([], True)
         if "~" in t:
             a, b = t.split("~")
             if not b:
@@ -106,10 +116,7 @@ def makeExpectedLrgOutput(s, pipe):
                 b = MAX_LINES
             if a < 1:
                 a = 1
-            if pipe and q and a <= max(q):
-                expect_error = True
-                break
-            q += list(range(a, b + 1))
+            r = list(range(a, b + 1))
         elif "-" in t:
             a, b = t.split("-")
             if not b:
@@ -123,10 +130,7 @@ def makeExpectedLrgOutput(s, pipe):
                 b = MAX_LINES
             if a < 1:
                 return ([], True)
-            if pipe and q and a <= max(q):
-                expect_error = True
-                break
-            q += list(range(a, b + 1))
+            r = list(range(a, b + 1))
         else:
             try:
                 a = int(t)
@@ -137,10 +141,8 @@ def makeExpectedLrgOutput(s, pipe):
             elif a > MAX_LINES:
                 expect_error = True
                 a = MAX_LINES
-            if pipe and q and a <= max(q):
-                expect_error = True
-                break
-            q.append(a)
+            r = [a]
+        q += r[::step]
     return [fuzz(x) for x in q], expect_error
 
 
@@ -155,8 +157,10 @@ class TestProgram():
         self.fname = fname
         self.pipe = pipe
 
-    def run(self, ranges):
-        proc = [self.name] + self.flags + [ranges]
+    def run(self, ranges, flags=[], raw=False):
+        proc = [self.name] + self.flags + flags
+        if ranges is not None:
+            proc.append(ranges)
         if self.pipe:
             if verbosity >= 1:
                 print(proc)
@@ -174,6 +178,8 @@ class TestProgram():
                 proc, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
             stdout, stderr = result.stdout.decode(
                 'ascii'), result.stderr.decode('ascii')
+        if raw:
+            return stdout, bool(stderr.strip())
         return convertLrgOutput(stdout), bool(stderr.strip())
 
 
@@ -182,7 +188,7 @@ class TestCase():
         self.text = text or ranges
         self.ranges = ranges
         self.description = description
-        self.expected = makeExpectedLrgOutput(self.ranges, False)
+        self.expected = makeExpectedLrgOutput(self.ranges)
         self.lastResult = None
 
     def run(self, program):
@@ -192,11 +198,295 @@ class TestCase():
         return self.expected == self.lastResult
 
 
-class TestCaseFailOnPipe(TestCase):
+class TestCaseUnique(TestCase):
+    def __init__(self, ranges, description=None):
+        super().__init__(ranges, description, ranges + " --unique")
+        lines, expect_error = self.expected
+        seen = set()
+        self.expected = ([x for x in lines if not (x in seen or seen.add(x))],
+                         expect_error)
+
+    def run(self, program):
+        self.lastResult = program.run(self.ranges, ["--unique"])
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseRangesFrom(TestCase):
+    def __init__(self, ranges, description=None):
+        super().__init__(ranges, description, ranges + " from file")
+        # the lines come in order and only once
+        lines, expect_error = self.expected
+        order = {fuzz(n): n for n in range(1, MAX_LINES + 1)}
+        self.expected = (sorted(set(lines), key=order.get), expect_error)
+
+    def run(self, program):
+        fn = "tmp-ranges.txt"
+        with open(fn, "w", encoding="ascii") as ff:
+            print("\n".join(self.ranges.split(",")), file=ff)
+        try:
+            self.lastResult = program.run(None, ["--ranges-from", fn])
+        finally:
+            deleteFile(fn)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseRangesFromStdin(TestCaseRangesFrom):
+    def __init__(self, ranges, description=None):
+        super().__init__(ranges, description)
+        self.text = ranges + " from stdin"
+        self.fileExpected = self.expected
+
+    def run(self, program):
+        proc = [program.name] + program.flags + ["--ranges-from", "-"]
+        if not program.pipe:
+            proc.append(program.fname)
+        if verbosity >= 1:
+            print(proc)
+        result = subprocess.run(
+            proc, input="\n".join(self.ranges.split(",")).encode('ascii'),
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        self.lastResult = (convertLrgOutput(result.stdout.decode('ascii')),
+                           bool(result.stderr.strip()))
+        self.expected = self.fileExpected
+        if program.pipe:
+            # the ranges take all of stdin, so it cannot be the input too
+            self.lastResult += (result.returncode != 0,)
+            self.expected = ([], True, True)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseSeekedStdin(TestCase):
+    def __init__(self, ranges, description=None):
+        super().__init__(ranges, description,
+                         ranges + " from a file on stdin read partway")
+
     def run(self, program):
         if program.pipe:
-            self.expected = makeExpectedLrgOutput(self.ranges, True)
-        return super().run(program)
+            return super().run(program)
+        # a file given as stdin is read from its start, however far it had
+        # been read before
+        proc = [program.name] + program.flags + [self.ranges, "-"]
+        if verbosity >= 1:
+            print(proc)
+        with open(program.fname, "rb") as f_in:
+            f_in.seek(1000)
+            result = subprocess.run(proc, stdin=f_in, stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE)
+        self.lastResult = (convertLrgOutput(result.stdout.decode('ascii')),
+                           bool(result.stderr.strip()))
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseNoNewline(TestCase):
+    def __init__(self, ranges, description=None):
+        super().__init__(ranges, description,
+                         ranges + " without a final newline")
+
+    def run(self, program):
+        # a copy of the test file without its final newline, the last line
+        # of which is output as it is
+        fn = "tmp-nonewline.txt"
+        with open(program.fname, "r", encoding="ascii", newline="") as ff:
+            lines = ff.read()[:-1].split("\n")
+        with open(fn, "w", encoding="ascii", newline="") as ff:
+            ff.write("\n".join(lines))
+        order = {fuzz(n): n for n in range(1, MAX_LINES + 1)}
+        numbers, expect_error = makeExpectedLrgOutput(self.ranges)
+        self.expected = ("".join(lines[order[x] - 1] +
+                                 ("" if order[x] == MAX_LINES else "\n")
+                                 for x in numbers), expect_error)
+        try:
+            self.lastResult = TestProgram(program.name, program.flags, fn,
+                                          program.pipe).run(self.ranges,
+                                                            raw=True)
+        finally:
+            deleteFile(fn)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseFromEnd(TestCase):
+    def __init__(self, ranges, description=None):
+        # $ is the last line, $-1 the one before it and so on
+        super().__init__(re.sub(
+            r"\$(-\d+)?", lambda m: str(MAX_LINES + int(m.group(1) or 0)),
+            ranges), description, ranges)
+        self.ranges = ranges
+
+
+class TestCaseSample(TestCase):
+    def __init__(self, k, seed, description=None):
+        self.flags = ["--sample", str(k), "--seed", str(seed)]
+        super().__init__("", description, " ".join(self.flags))
+        # the lines are random, so check that they could have been picked
+        self.count = min(k, MAX_LINES)
+        self.expected = "{} different lines in order, the same every time" \
+            .format(self.count)
+
+    def run(self, program):
+        lines, error = program.run(None, self.flags)
+        again = program.run(None, self.flags)
+        order = {fuzz(n): n for n in range(1, MAX_LINES + 1)}
+        numbers = [order.get(x) for x in lines]
+        self.lastResult = (lines, error)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return (not error and (lines, error) == again and
+                None not in numbers and numbers == sorted(set(numbers)) and
+                len(numbers) == self.count)
+
+
+class TestCaseCount(TestCase):
+    def __init__(self, description=None):
+        super().__init__("", description, "--count")
+        self.expected = "{} and the file name".format(MAX_LINES)
+
+    def run(self, program):
+        self.lastResult = program.run(None, ["--count"])
+        name = "(stdin)" if program.pipe else program.fname
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.lastResult == (["{} {}".format(MAX_LINES, name)], False)
+
+
+class TestCaseFiles(TestCase):
+    # lines in each file; None is a file that does not exist
+    FILES = [MAX_LINES, 3, 0, 500, MAX_LINES]
+
+    def __init__(self, ranges, flags=[], files=FILES, description=None):
+        super().__init__(ranges, description,
+                         " ".join(flags + [ranges]) + " on {} files"
+                         .format(len(files)))
+        self.flags = flags
+        self.files = files
+        self.expected = "the same output and exit code as with --jobs 1"
+
+    def runWith(self, program, names, jobs):
+        result = subprocess.run(
+            [program.name] + program.flags + self.flags +
+            ["--jobs", str(jobs), self.ranges] + names,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        return result.stdout, result.returncode, bool(result.stderr.strip())
+
+    def run(self, program):
+        names = []
+        try:
+            for i, lines in enumerate(self.files):
+                fn = "tmp-files-{}.txt".format(i + 1)
+                if lines is not None:
+                    # every file has lines of its own
+                    with open(fn, "w", encoding="ascii") as ff:
+                        for n in range(lines):
+                            print(i + 1, fuzz(n + 1), file=ff)
+                names.append(fn)
+            self.expected = self.runWith(program, names, 1)
+            self.lastResult = self.runWith(program, names, 3)
+        finally:
+            for fn in names:
+                if os.path.exists(fn):
+                    deleteFile(fn)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult and bool(self.expected[0])
+
+
+class TestCaseLyingIndex(TestCase):
+    LINES = 200000
+
+    def __init__(self, description=None):
+        self.text = "lying index"
+        self.ranges = None
+        self.description = description
+        self.expected = None
+        self.lastResult = None
+
+    def runOn(self, program, fn, line):
+        proc = [program.name] + program.flags + [str(line), fn]
+        if verbosity >= 1:
+            print(proc)
+        result = subprocess.run(proc, stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE)
+        return convertLrgOutput(result.stdout.decode('ascii'))
+
+    def run(self, program):
+        # large enough not to be read whole, so that the index is used
+        fn = "tmp-lying.txt"
+        with open(fn, "w", encoding="ascii") as ff:
+            for n in range(self.LINES):
+                print(n + 1, "x" * 20, file=ff)
+        try:
+            subprocess.run([program.name, "--build-index", fn],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            with open(fn + ".lrgidx", "r+b") as ff:
+                data = bytearray(ff.read())
+                interval = int.from_bytes(data[8:16], "little")
+                count = int.from_bytes(data[32:40], "little")
+                line = 1 + interval
+                honest = self.runOn(program, fn, line)
+                # move the offset of line 1 + interval by a few bytes, into
+                # the middle of a line
+                data[104 + (count // 256 + 1) * 16] ^= 4
+                ff.seek(0)
+                ff.write(data)
+            lied = self.runOn(program, fn, line)
+        finally:
+            deleteFile(fn)
+            if os.path.exists(fn + ".lrgidx"):
+                deleteFile(fn + ".lrgidx")
+        self.expected = (["{} {}".format(line, "x" * 20)], True)
+        self.lastResult = (honest, honest != lied)
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
+
+
+class TestCaseEditedIndex(TestCaseLyingIndex):
+    def __init__(self, description=None):
+        super().__init__(description)
+        self.text = "edited and appended"
+
+    def run(self, program):
+        fn = "tmp-edited.txt"
+        lines = ["{} {}".format(n + 1, "x" * 20) for n in range(self.LINES)]
+        with open(fn, "w", encoding="ascii") as ff:
+            print("\n".join(lines), file=ff)
+        try:
+            subprocess.run([program.name, "--build-index", fn],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            # split a line in the middle in place, then append to the file
+            middle = self.LINES // 2
+            with open(fn, "r+b") as ff:
+                ff.seek(sum(len(x) + 1 for x in lines[:middle]) + 10)
+                ff.write(b"\n\n\n")
+            with open(fn, "ab") as ff:
+                ff.write(b"zz\n")
+            with open(fn, "r", encoding="ascii") as ff:
+                edited = ff.read().splitlines()
+            line = self.LINES * 3 // 4
+            proc = [program.name] + program.flags + ["--count", fn]
+            if verbosity >= 1:
+                print(proc)
+            count = subprocess.run(proc, stdout=subprocess.PIPE,
+                                   stderr=subprocess.PIPE)
+            self.lastResult = (count.stdout.decode('ascii').split()[:1],
+                               self.runOn(program, fn, line))
+        finally:
+            deleteFile(fn)
+            if os.path.exists(fn + ".lrgidx"):
+                deleteFile(fn + ".lrgidx")
+        self.expected = ([str(len(edited))], [edited[line - 1]])
+        if verbosity >= 2:
+            print(self.expected, self.lastResult)
+        return self.expected == self.lastResult
 
 
 def printTestSetHeader(header):
@@ -325,38 +615,141 @@ testGroups = [TestGroup(
 ), TestGroup(
     "Seeking backwards",
     [
-        TestCaseFailOnPipe("2,1"),
-        TestCaseFailOnPipe("6000,4000"),
-        TestCaseFailOnPipe("6000,2000"),
-        TestCaseFailOnPipe("9000,1000"),
-        TestCaseFailOnPipe("9001,1520"),
-        TestCaseFailOnPipe("9002,2222"),
-        TestCaseFailOnPipe("9003,2222,4444,6666,8888"),
-        TestCaseFailOnPipe("9004,2222,4444,6666,8888,4444,6666,2222"),
-        TestCaseFailOnPipe("1,1"),
-        TestCaseFailOnPipe("7538,3239,708,8325,8325,5450,1326,7203,3237,1326"),
+        TestCase("2,1"),
+        TestCase("6000,4000"),
+        TestCase("6000,2000"),
+        TestCase("9000,1000"),
+        TestCase("9001,1520"),
+        TestCase("9002,2222"),
+        TestCase("9003,2222,4444,6666,8888"),
+        TestCase("9004,2222,4444,6666,8888,4444,6666,2222"),
+        TestCase("1,1"),
+        TestCase("7538,3239,708,8325,8325,5450,1326,7203,3237,1326"),
+        TestCase("{}-,{}".format(MAX_LINES - 19, MAX_LINES - 14),
+                 "should find the line in what was read to the end"),
+        TestCase("{}-,{}".format(MAX_LINES - 7, MAX_LINES - 13),
+                 "should not warn about EOF"),
+    ]
+), TestGroup(
+    "No newline at the end",
+    [
+        TestCaseNoNewline("{}-".format(MAX_LINES - 2)),
+        TestCaseNoNewline("{}-,{}-".format(MAX_LINES, MAX_LINES)),
+        TestCaseNoNewline("{}-,{}-,10-20".format(MAX_LINES - 3, MAX_LINES),
+                          "should not lose the last line"),
     ]
 ), TestGroup(
     "Random single-line tests",
     [
-        TestCase(",".join(str(random.randint(1, MAX_LINES)
-                 for i in range(20))), text="Batch {}/5".format(j + 1))
+        TestCase(",".join(str(random.randint(1, MAX_LINES))
+                          for i in range(20)), text="Batch {}/5".format(j + 1))
         for j in range(5)
     ]
+), TestGroup(
+    "Unique lines",
+    [
+        TestCaseUnique("1-10,5-15"),
+        TestCaseUnique("20-30,1-25"),
+        TestCaseUnique("5~3,1-20,3"),
+        TestCaseUnique("9004,2222,4444,6666,8888,4444,6666,2222"),
+        TestCaseUnique("{}-{},{}~4".format(MAX_LINES - 5, MAX_LINES - 2,
+                                              MAX_LINES - 3),
+                       "should warn about EOF"),
+    ]
+), TestGroup(
+    "Ranges from a file",
+    [
+        TestCaseRangesFrom("5"),
+        TestCaseRangesFrom("9000,1000,5000-5010,5005~10"),
+        TestCaseRangesFrom("7538,3239,708,8325,8325,5450,1326,7203,3237,1326"),
+        TestCaseRangesFrom("{}-,20-30".format(MAX_LINES - 10)),
+        TestCaseRangesFromStdin("9000,1000,5000-5010"),
+        TestCaseRangesFrom("{}-{},2".format(MAX_LINES - 1, MAX_LINES + 1),
+                           "should warn about EOF"),
+    ]
+), TestGroup(
+    "Files on stdin",
+    [
+        TestCaseSeekedStdin("1-3,5000"),
+        TestCaseSeekedStdin("{}-,10".format(MAX_LINES - 2)),
+    ]
+), TestGroup(
+    "Ranges with a step",
+    [
+        TestCase("1-50:7"),
+        TestCase("100-:1000"),
+        TestCase("{}-:3".format(MAX_LINES - 10), "should not warn about EOF"),
+        TestCase("{}-{}:5".format(MAX_LINES - 5, MAX_LINES + 5),
+                 "should warn about EOF"),
+        TestCase("20~10:4"),
+        TestCase("5000-5100:10,4000-4050:25,4010"),
+        TestCase("1-10:0", "should cause an invalid range error"),
+        TestCaseUnique("1-20,1-30:4"),
+    ]
+), TestGroup(
+    "Random samples",
+    [
+        TestCaseSample(1, 1),
+        TestCaseSample(10, 2),
+        TestCaseSample(1000, 3),
+        TestCaseSample(MAX_LINES - 10, 4),
+        TestCaseSample(MAX_LINES * 2, 5),
+    ]
+), TestGroup(
+    "Counting lines",
+    [
+        TestCaseCount(),
+    ]
+), TestGroup(
+    "Lines counted from the end",
+    [
+        TestCaseFromEnd("$"),
+        TestCaseFromEnd("$-199-$"),
+        TestCaseFromEnd("$-5000-$-4000"),
+        TestCaseFromEnd("$-2~1"),
+        TestCaseFromEnd("$-9-,$-20-$-15"),
+        TestCaseFromEnd("$-3,1-3"),
+        TestCaseFromEnd("5,$-5,6000"),
+        TestCaseFromEnd("$-100-$:25"),
+    ]
 )]
 assert MAX_LINES >= 10000
 
+# run with several input files rather than the test file
+filesTestGroup = TestGroup(
+    "Several files",
+    [
+        TestCaseFiles("1-5,8000"),
+        TestCaseFiles("2,1,300-", ["-f"]),
+        TestCaseFiles("1-2", ["-f"], [3, MAX_LINES, None, 3, MAX_LINES],
+                      "should stop at the missing file"),
+        TestCaseFiles("400-600,{}-{}".format(MAX_LINES - 1, MAX_LINES + 1),
+                      ["-f"], description="should warn about EOF"),
+        TestCaseFiles("5~3", ["-l"], [MAX_LINES] * 8),
+    ]
+)
+
+
+indexTestGroup = TestGroup(
+    "Index use",
+    [
+        TestCaseLyingIndex("a wrong offset in the index should be followed"),
+        TestCaseEditedIndex("the index should not be used until rebuilt"),
+    ]
+)
+
 
-def createFile():
+def createFile(width=0):
     n = 1
     while True:
         f = "tmp-{}.txt".format(n)
         if not os.path.exists(f):
             break
         n += 1
+    # with a width, lines are padded with spaces to be that long
     with open(f, "w", encoding="ascii") as ff:
         for n in range(MAX_LINES):
-            print(fuzz(n + 1), file=ff)
+            print(fuzz(n + 1).ljust(width - 1), file=ff)
     return f
 
 
@@ -369,20 +762,99 @@ def runTests(argv):
     BINARY = "lrg"
     verbosity = argv.count("-v")
     noflags = False
-    for v in argv[1:]:
+    # anything after the binary name is passed to lrg as extra flags
+    extraFlags = []
+    for i, v in enumerate(argv[1:]):
         if noflags or not v.startswith("-"):
             BINARY = v
+            extraFlags = argv[i + 2:]
             break
         elif v == "--":
             noflags = True
-    print("<<< Testing {} >>>".format(BINARY))
+    print("<<< Testing {} >>>".format(" ".join([BINARY] + extraFlags)))
     tmp = createFile()
     try:
         printTestSetHeader("File mode")
-        p = TestProgram(BINARY, ["-w"], tmp, False)
+        p = TestProgram(BINARY, ["-w"] + extraFlags, tmp, False)
         for g in testGroups:
             if not g.run(p):
                 return 1
+        printTestSetHeader("Several files mode")
+        result = subprocess.run([BINARY, "--jobs", "2", "1", tmp],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        if result.returncode == 0:
+            if not filesTestGroup.run(p):
+                return 1
+        else:
+            colorPrint("yellow", "WARNING: --jobs not supported, cannot test")
+            print("")
+        printTestSetHeader("Output thread mode")
+        result = subprocess.run([BINARY, "--threads-out", "1", tmp],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        if result.returncode == 0:
+            pt = TestProgram(BINARY, ["-w", "--threads-out"] + extraFlags,
+                             tmp, False)
+            for g in testGroups:
+                if not g.run(pt):
+                    return 1
+        else:
+            colorPrint("yellow",
+                       "WARNING: --threads-out not supported, cannot test")
+            print("")
+        printTestSetHeader("Indexed file mode")
+        result = subprocess.run([BINARY, "--build-index", tmp],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        if result.returncode == 0 and os.path.exists(tmp + ".lrgidx"):
+            try:
+                for g in testGroups:
+                    if not g.run(p):
+                        return 1
+            finally:
+                deleteFile(tmp + ".lrgidx")
+            if "--no-index" not in extraFlags and not indexTestGroup.run(p):
+                return 1
+            printTestSetHeader("Appended indexed file mode")
+            # index the file cut in the middle of a line, then append the rest
+            with open(tmp, "rb") as ff:
+                data = ff.read()
+            cut = len(data) * 2 // 3 + 1
+            with open(tmp, "wb") as ff:
+                ff.write(data[:cut])
+            subprocess.run([BINARY, "--build-index", tmp],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            with open(tmp, "ab") as ff:
+                ff.write(data[cut:])
+            # which extends the index to the appended part
+            subprocess.run([BINARY, "--build-index", tmp],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            try:
+                for g in testGroups:
+                    if not g.run(p):
+                        return 1
+            finally:
+                deleteFile(tmp + ".lrgidx")
+        else:
+            colorPrint("yellow", "WARNING: indexes not supported, cannot test")
+            print("")
+        printTestSetHeader("Fixed-width file mode")
+        fixed = createFile(17)
+        try:
+            result = subprocess.run([BINARY, "--record-size", "auto", "1",
+                                     fixed], stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE)
+            if result.returncode == 0:
+                for flags in (["auto"], ["17"]):
+                    p = TestProgram(BINARY, ["-w", "--record-size"] + flags
+                                    + extraFlags, fixed, False)
+                    for g in testGroups:
+                        if not g.run(p):
+                            return 1
+            else:
+                colorPrint("yellow",
+                           "WARNING: --record-size not supported, cannot test")
+                print("")
+        finally:
+            deleteFile(fixed)
         printTestSetHeader("Pipe mode")
         try:
             r, w = os.pipe()
@@ -393,7 +865,7 @@ def runTests(argv):
             pipe = False
             traceback.print_exc()
         if pipe:
-            p = TestProgram(BINARY, ["-w"], tmp, True)
+            p = TestProgram(BINARY, ["-w"] + extraFlags, tmp, True)
             for g in testGroups:
                 if not g.run(p):
                     return 1